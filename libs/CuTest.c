@@ -7,6 +7,19 @@
 
 #include "CuTest.h"
 
+#ifndef _WIN32
+#include <ctype.h>
+
+/* _strupr is MSVC-only, provide it elsewhere */
+static char* _strupr(char* str)
+{
+	char* c;
+	for (c = str; *c; c++)
+		*c = (char) toupper((unsigned char) *c);
+	return str;
+}
+#endif
+
 /*-------------------------------------------------------------------------*
  * CuStr
  *-------------------------------------------------------------------------*/
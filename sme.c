@@ -1,4 +1,7 @@
+#define SME_IMPLEMENTATION
+#include <math.h>
 #include "sme.h"
+#include "sme_static.h"
 #include "./libs/CuTest.h"
 
 SMETokenizer* tokenizer;
@@ -88,6 +91,1466 @@ void test_variables(CuTest* tc){
     free_SMETokenizer(tokenizer);
 }
 
+void test_compile(CuTest* tc){
+    vars = new_SMEList();
+    append_SMEItem(vars, new_SMEVar("a", 3.4));
+    append_SMEItem(vars, new_SMEVar("b", 5.6));
+    append_SMEItem(vars, new_SMEVar("x", -9.23));
+    append_SMEItem(vars, new_SMEVar("y", 2));
+    SMEExpr* expr = sme_compile("a + b * x / y + z", vars);
+
+    CuAssertIntEquals(tc, 5, expr->slots->count);
+    CuAssertIntEquals(tc, 0, sme_slot(expr, "a"));
+    CuAssertIntEquals(tc, 4, sme_slot(expr, "z"));
+    CuAssertIntEquals(tc, -1, sme_slot(expr, "w"));
+    CuAssertDblEquals(tc, 3.4 + 5.6 * -9.23 / 2, sme_evaluate(expr), 0.001);
+
+    /* Rebinding only touches the slot values */
+    sme_bind(expr, sme_slot(expr, "a"), 1);
+    CuAssertIntEquals(tc, 4, sme_bind_name(expr, "z", 10));
+    CuAssertIntEquals(tc, -1, sme_bind_name(expr, "w", 10));
+    CuAssertDblEquals(tc, 1 + 5.6 * -9.23 / 2 + 10, sme_evaluate(expr), 0.001);
+    free_SMEExpr(expr);
+
+    /* The caller keeps ownership of the variable list */
+    CuAssertIntEquals(tc, 4, vars->count);
+    for (int i = 0; i < vars->count; i++) {
+        free_SMEVar(vars->items[i]);
+    }
+    free_SMEList(vars);
+
+    expr = sme_compile("+(2 * (4 / (2.2 + -5.4) - 22) * 2 + ceil(floor(33.4 + 2.4) * 2.4))", NULL);
+    CuAssertDblEquals(tc, 9, sme_evaluate(expr), 0.001);
+    free_SMEExpr(expr);
+}
+
+void test_bytecode(CuTest* tc){
+    char* exprs[] = {
+            "+(2 * (4 / (2.2 + -5.4) - 22) * 2 + ceil(floor(33.4 + 2.4) * 2.4))",
+            "a - (b - (x - (y - a)))",
+            "floor(a * b) / ceil(x) - -y",
+            "a * b * x / y / a"
+    };
+    double row[] = { 3.4, 5.6, -9.23, 2 };
+    vars = new_SMEList();
+
+    SMEExpr* expr = sme_compile(exprs[0], vars);
+    /* 21 nodes in postfix order followed by the end marker */
+    CuAssertIntEquals(tc, 22, expr->code->count);
+    CuAssertIntEquals(tc, SMEOpEnd, expr->code->instrs[21].op);
+    CuAssertIntEquals(tc, 4, expr->code->depth);
+    free_SMEExpr(expr);
+
+    expr = sme_compile(exprs[1], vars);
+    CuAssertIntEquals(tc, 5, expr->code->depth);
+    free_SMEExpr(expr);
+
+    for (int i = 0; i < 4; i++) {
+        expr = sme_compile(exprs[i], vars);
+        for (int j = 0; j < expr->slots->count; j++) {
+            sme_bind(expr, j, row[j]);
+        }
+        CuAssertDblEquals(tc, sme_eval_slots(expr->root, expr->values), sme_evaluate(expr), 0);
+        free_SMEExpr(expr);
+    }
+    free_SMEList(vars);
+
+    expr = sme_compile("", NULL);
+    CuAssertDblEquals(tc, 0, sme_evaluate(expr), 0);
+    free_SMEExpr(expr);
+}
+
+void test_batch(CuTest* tc){
+    int rows = 1000;
+    double* a = malloc(sizeof(double) * rows);
+    double* b = malloc(sizeof(double) * rows);
+    double* x = malloc(sizeof(double) * rows);
+    double* out = malloc(sizeof(double) * rows);
+    for (int i = 0; i < rows; i++) {
+        a[i] = i * 0.5 - 100;
+        b[i] = (i % 7) - 3.25;
+        x[i] = 1000.0 / (i + 1);
+    }
+    vars = new_SMEList();
+    SMEExpr* expr = sme_compile("floor(a + b * x / y) - ceil(-a) * +b", vars);
+    const double* columns[] = { a, b, x, NULL };
+    sme_bind(expr, sme_slot(expr, "y"), 3);
+    sme_evaluate_batch(expr, columns, out, rows);
+
+    /* Every row matches the scalar evaluation exactly, including the tail block */
+    for (int i = 0; i < rows; i++) {
+        sme_bind(expr, 0, a[i]);
+        sme_bind(expr, 1, b[i]);
+        sme_bind(expr, 2, x[i]);
+        CuAssertDblEquals(tc, sme_evaluate(expr), out[i], 0);
+    }
+    free_SMEExpr(expr);
+    free_SMEList(vars);
+    free(a);
+    free(b);
+    free(x);
+    free(out);
+}
+
+void test_kernels(CuTest* tc){
+    char* names[] = { "scalar", "sse2", "avx2", "avx512" };
+    char* exprs[] = { "floor(a)", "ceil(a)", "+a", "-a", "a + b", "a - b", "a * b", "a / b", "floor(a / b) - ceil(-b * a)" };
+    double specials[] = { 0.0, -0.0, 0.5, -0.5, 1.5, -1.5, 2, -2, 2.5, -2.5, 0.999999, -0.999999,
+                          4503599627370495.5, -4503599627370495.5, 4503599627370496.0, 1e300, -1e300,
+                          3e9, -3e9, 1.0 / 0.0, -1.0 / 0.0, 0.0 / 0.0, 5e-324, -5e-324 };
+    int count = sizeof(specials) / sizeof(specials[0]);
+    int rows = count * count;
+    double* a = malloc(sizeof(double) * rows);
+    double* b = malloc(sizeof(double) * rows);
+    double* out = malloc(sizeof(double) * rows);
+    double* expected = malloc(sizeof(double) * rows);
+    for (int i = 0; i < rows; i++) {
+        a[i] = specials[i / count];
+        b[i] = specials[i % count];
+    }
+    const double* columns[] = { a, b };
+
+    /* The scalar rounding no longer goes through int */
+    CuAssertDblEquals(tc, -2, sme_floor(-2), 0);
+    CuAssertDblEquals(tc, -3, sme_floor(-2.5), 0);
+    CuAssertDblEquals(tc, -2, sme_ceil(-2.5), 0);
+    CuAssertDblEquals(tc, 1e300, sme_floor(1e300), 0);
+    CuAssertDblEquals(tc, 3e9 + 1, sme_ceil(3e9 + 0.5), 0);
+
+    vars = new_SMEList();
+    for (int e = 0; e < (int)(sizeof(exprs) / sizeof(exprs[0])); e++) {
+        SMEExpr* expr = sme_compile(exprs[e], vars);
+        for (int i = 0; i < rows; i++) {
+            sme_bind(expr, 0, a[i]);
+            if (expr->slots->count > 1) sme_bind(expr, 1, b[i]);
+            expected[i] = sme_evaluate(expr);
+        }
+        /* Every kernel set this CPU runs has to match the scalar VM bit for bit */
+        for (int k = 0; k < 4; k++) {
+            if (sme_select_kernels(names[k])) continue;
+            sme_evaluate_batch(expr, columns, out, rows);
+            CuAssertTrue(tc, !memcmp(expected, out, sizeof(double) * rows));
+        }
+        free_SMEExpr(expr);
+    }
+    CuAssertIntEquals(tc, -1, sme_select_kernels("mmx"));
+    sme_select_kernels(sme_detect_kernels()->name);
+    free_SMEList(vars);
+    free(a);
+    free(b);
+    free(out);
+    free(expected);
+}
+
+void test_arena(CuTest* tc){
+    char* buffer = "+(2 * (4 / (2.2 + -5.4) - 22) * 2 + ceil(floor(33.4 + 2.4) * 2.4))";
+    SMEArena* arena = new_SMEArena(64);
+    vars = new_SMEList();
+    append_SMEItem(vars, new_SMEVar("a", 3.4));
+    append_SMEItem(vars, new_SMEVar("b", 5.6));
+
+    for (int i = 0; i < 3; i++) {
+        void* first = sme_arena_alloc(arena, 3);
+        void* second = sme_arena_alloc(arena, 8);
+        CuAssertIntEquals(tc, 0, (int) ((uintptr_t) first % 16));
+        CuAssertIntEquals(tc, 0, (int) ((uintptr_t) second % 16));
+        sme_arena_reset(arena);
+    }
+
+    CuAssertDblEquals(tc, 9, sme_calc_arena(buffer, vars, arena), 0.001);
+    /* The blocks the first call needed were merged into one on reset */
+    CuAssertTrue(tc, arena->head->next == NULL);
+    CuAssertTrue(tc, arena->head->size > 64);
+
+    /* From here on the same block is reused without growing */
+    SMEArenaBlock* block = arena->head;
+    for (int i = 0; i < 10; i++) {
+        CuAssertDblEquals(tc, 9, sme_calc_arena(buffer, vars, arena), 0.001);
+        CuAssertDblEquals(tc, 3.4 + 5.6 * 2, sme_calc_arena("a + b * 2", vars, arena), 0.001);
+        CuAssertTrue(tc, arena->head == block && block->next == NULL);
+    }
+
+    /* Tokens and nodes can also be kept until the caller resets */
+    tokenizer = sme_tokenize_arena("a * (b - 1)", vars, arena);
+    CuAssertIntEquals(tc, 7, tokenizer->list->count);
+    root = sme_parse(tokenizer);
+    CuAssertDblEquals(tc, 3.4 * 4.6, sme_eval(root), 0.001);
+    sme_arena_reset(arena);
+
+    free_SMEArena(arena);
+    CuAssertIntEquals(tc, 2, vars->count);
+    for (int i = 0; i < vars->count; i++) {
+        free_SMEVar(vars->items[i]);
+    }
+    free_SMEList(vars);
+}
+
+void test_var_table(CuTest* tc){
+    SMEVarTable* table = new_SMEVarTable();
+    char name[8];
+
+    /* Enough names to rehash the buckets and grow the arrays several times */
+    for (int i = 0; i < 1000; i++) {
+        sprintf(name, "%c%c%c", 'a' + i % 26, 'a' + i / 26 % 26, 'a' + i / 676);
+        CuAssertIntEquals(tc, i, sme_var_set(table, name, i * 0.5));
+    }
+    CuAssertIntEquals(tc, 1000, table->count);
+    for (int i = 0; i < 1000; i++) {
+        sprintf(name, "%c%c%c", 'a' + i % 26, 'a' + i / 26 % 26, 'a' + i / 676);
+        int id = sme_var_lookup(table, name);
+        CuAssertIntEquals(tc, i, id);
+        CuAssertStrEquals(tc, name, table->names[id]);
+        CuAssertDblEquals(tc, i * 0.5, table->values[id], 0);
+    }
+
+    /* Setting an existing name updates it in place, lookups need no terminator */
+    CuAssertIntEquals(tc, 3, sme_var_set(table, "daa", -1));
+    CuAssertIntEquals(tc, 1000, table->count);
+    CuAssertIntEquals(tc, 3, sme_var_find(table, "daab", 3));
+    CuAssertIntEquals(tc, -1, sme_var_lookup(table, "zzzz"));
+    CuAssertIntEquals(tc, -1, sme_var_lookup(table, ""));
+
+    CuAssertDblEquals(tc, -1 + 0.5 * 1, sme_calc_table("daa + baa * caa", table), 0);
+    tokenizer = sme_tokenize_table("baa * unknown", table);
+    CuAssertIntEquals(tc, 2, tokenizer->list->count);
+    free_SMETokenizer(tokenizer);
+    free_SMEVarTable(table);
+}
+
+void test_lexer(CuTest* tc){
+    char* buffer = "+(2 * (4 / (2.2 + -5.4) - 22) * 2 + ceil(floor(33.4 + 2.4) * 2.4))";
+    SMEToken tokens[64];
+    SMEVarTable* table = new_SMEVarTable();
+
+    /* Same tokens as the tokenizer */
+    int count = sme_lex(buffer, strlen(buffer), table, tokens, 64);
+    tokenizer = sme_tokenize(buffer, NULL);
+    CuAssertIntEquals(tc, tokenizer->list->count, count);
+    for (int i = 0; i < count; i++) {
+        SMEToken* token = tokenizer->list->items[i];
+        CuAssertIntEquals(tc, token->type, tokens[i].type);
+        CuAssertDblEquals(tc, token->value, tokens[i].value, 0);
+    }
+    free_SMETokenizer(tokenizer);
+
+    /* Only length bytes are read, no terminator needed */
+    CuAssertIntEquals(tc, 3, sme_lex("2+3xyz", 3, NULL, tokens, 64));
+    CuAssertDblEquals(tc, 3, tokens[2].value, 0);
+    CuAssertIntEquals(tc, 3, sme_lex("a * floorb", 10, table, tokens, 64));
+    CuAssertIntEquals(tc, SMEVarRef, tokens[2].type);
+    CuAssertStrEquals(tc, "floorb", table->names[tokens[2].slot]);
+    CuAssertIntEquals(tc, SME_LEX_OVERFLOW, sme_lex(buffer, strlen(buffer), table, tokens, 8));
+    CuAssertIntEquals(tc, SME_LEX_ERROR, sme_lex("2 $ 3", 5, table, tokens, 64));
+    CuAssertIntEquals(tc, SME_LEX_ERROR, sme_lex("2 * a", 5, NULL, tokens, 64));
+    CuAssertPtrEquals(tc, NULL, sme_compile("2 ^ 3", NULL));
+
+    /* The fast path agrees with strtod bit for bit, the rest falls back to it */
+    char* numbers[] = { "0", "1", "2.2", "5.4", "33.4", "0.1", "0.3", "123456.789", "9007199254740992",
+                        "9007199254740993", "1234567890123456789", "12345678901234567890", "0.0000000000000000000000001",
+                        "3.14159265358979323846264338327950288", "1.", "000000000000000000000000000042.5" };
+    for (int i = 0; i < (int)(sizeof(numbers) / sizeof(numbers[0])); i++) {
+        double expected = strtod(numbers[i], NULL);
+        double value = sme_parse_number(numbers[i], strlen(numbers[i]));
+        CuAssertTrue(tc, !memcmp(&expected, &value, sizeof(double)));
+    }
+    srand(7);
+    for (int i = 0; i < 10000; i++) {
+        char number[32];
+        sprintf(number, "%d.%0*d", rand() % 100000, rand() % 9 + 1, rand() % 1000);
+        double expected = strtod(number, NULL);
+        double value = sme_parse_number(number, strlen(number));
+        CuAssertTrue(tc, !memcmp(&expected, &value, sizeof(double)));
+    }
+
+    /* Numbers and names longer than the old 256 byte scratch buffer */
+    char long_buffer[1000];
+    memset(long_buffer, '7', 300);
+    long_buffer[300] = '+';
+    memset(long_buffer + 301, 'q', 600);
+    long_buffer[901] = '\0';
+    count = sme_lex(long_buffer, strlen(long_buffer), table, tokens, 64);
+    CuAssertIntEquals(tc, 3, count);
+    CuAssertIntEquals(tc, 600, table->lengths[tokens[2].slot]);
+    CuAssertDblEquals(tc, 7.777777777777778e299, tokens[0].value, 1e284);
+    /* sme_calc frees the list it is given, sme_compile leaves it to the caller */
+    SMEList* calc_vars = new_SMEList();
+    append_SMEItem(calc_vars, new_SMEVar(long_buffer + 301, 1));
+    CuAssertDblEquals(tc, tokens[0].value + 1, sme_calc(long_buffer, calc_vars), 0);
+    vars = new_SMEList();
+    append_SMEItem(vars, new_SMEVar(long_buffer + 301, 1));
+    SMEExpr* expr = sme_compile(long_buffer, vars);
+    CuAssertDblEquals(tc, tokens[0].value + 1, sme_evaluate(expr), 0);
+    sme_bind(expr, 0, -tokens[0].value);
+    CuAssertDblEquals(tc, 0, sme_evaluate(expr), 0);
+    free_SMEExpr(expr);
+    for (int i = 0; i < vars->count; i++) {
+        free_SMEVar(vars->items[i]);
+    }
+    free_SMEList(vars);
+    free_SMEVarTable(table);
+}
+
+void test_stream(CuTest* tc){
+    char* exprs[] = {
+            "+(2 * (4 / (2.2 + -5.4) - 22) * 2 + ceil(floor(33.4 + 2.4) * 2.4))",
+            "alpha + beta * gamma / delta",
+            "alpha / beta * gamma - delta - alpha",
+            "- - alpha * -beta + floor ceil gamma / (delta)",
+            "((((alpha))))-(beta-(gamma-(delta-1.125)))",
+            "   12345.678   *alpha",
+            ""
+    };
+    char* errors[] = { "2 +", "(2", "2)", "2 3", "2 $ 3", "-", "zeta * 2", "()", "2+a" };
+    SMEVarTable* table = new_SMEVarTable();
+    sme_var_set(table, "alpha", 3.4);
+    sme_var_set(table, "beta", 5.6);
+    sme_var_set(table, "gamma", -9.23);
+    sme_var_set(table, "delta", 2);
+
+    for (int e = 0; e < (int)(sizeof(exprs) / sizeof(exprs[0])); e++) {
+        int length = (int) strlen(exprs[e]);
+        SMEExpr* expected = sme_compile(exprs[e], NULL);
+        for (int i = 0; i < expected->slots->count; i++) {
+            sme_bind(expected, i, table->values[sme_var_lookup(table, expected->slots->names[i])]);
+        }
+        double value = sme_evaluate(expected);
+
+        /* Every chunk size splits numbers and names at every possible position */
+        for (int size = 1; size <= length + 1; size++) {
+            SMEStream* stream = new_SMEStream(table);
+            for (int i = 0; i < length; i += size) {
+                CuAssertIntEquals(tc, 0, sme_stream_feed(stream, exprs[e] + i, length - i < size ? length - i : size));
+            }
+            CuAssertIntEquals(tc, 0, sme_stream_end(stream));
+            CuAssertDblEquals(tc, value, stream->result, 0);
+            free_SMEStream(stream);
+        }
+
+        SMEStream* stream = new_SMEStream_code();
+        for (int i = 0; i < length; i += 3) {
+            sme_stream_feed(stream, exprs[e] + i, length - i < 3 ? length - i : 3);
+        }
+        CuAssertIntEquals(tc, 0, sme_stream_end(stream));
+        SMEExpr* expr = sme_stream_expr(stream);
+        free_SMEStream(stream);
+        CuAssertIntEquals(tc, expected->code->count, expr->code->count);
+        CuAssertIntEquals(tc, expected->code->depth, expr->code->depth);
+        for (int i = 0; i < expr->slots->count; i++) {
+            sme_bind(expr, i, table->values[sme_var_lookup(table, expr->slots->names[i])]);
+        }
+        CuAssertDblEquals(tc, value, sme_evaluate(expr), 0);
+        free_SMEExpr(expr);
+        free_SMEExpr(expected);
+    }
+
+    /* Without a table every name is an error */
+    for (int e = 0; e < (int)(sizeof(errors) / sizeof(errors[0])) * 2; e++) {
+        int index = e % (int)(sizeof(errors) / sizeof(errors[0]));
+        SMEStream* stream = new_SMEStream(e == index ? table : NULL);
+        sme_stream_feed(stream, errors[index], strlen(errors[index]));
+        CuAssertTrue(tc, sme_stream_end(stream) < 0);
+        free_SMEStream(stream);
+    }
+    SMEStream* stream = new_SMEStream(NULL);
+    sme_stream_feed(stream, "2+a", 3);
+    CuAssertIntEquals(tc, SME_LEX_ERROR, sme_stream_end(stream));
+    free_SMEStream(stream);
+    free_SMEVarTable(table);
+}
+
+/* Whether two trees have the same shape, operations and values, NaN matching NaN */
+int test_same_tree(SMENode* a, SMENode* b) {
+    if (a == NULL || b == NULL) return a == b;
+    return a->type == b->type && a->slot == b->slot && (a->value == b->value || a->value != a->value) &&
+           test_same_tree(a->left, b->left) && test_same_tree(a->right, b->right);
+}
+
+/* Builds prefix, count times, then the middle, then suffix count times */
+char* test_nest(const char* prefix, const char* middle, const char* suffix, int count) {
+    size_t p = strlen(prefix), m = strlen(middle), s = strlen(suffix);
+    char* buffer = malloc((p + s) * count + m + 1);
+    char* c = buffer;
+    for (int i = 0; i < count; i++, c += p) memcpy(c, prefix, p);
+    memcpy(c, middle, m);
+    c += m;
+    for (int i = 0; i < count; i++, c += s) memcpy(c, suffix, s);
+    *c = '\0';
+    return buffer;
+}
+
+void test_iterative(CuTest* tc){
+    char* exprs[] = {
+            "+(2 * (4 / (2.2 + -5.4) - 22) * 2 + ceil(floor(33.4 + 2.4) * 2.4))",
+            "alpha + beta * gamma / delta",
+            "alpha / beta * gamma - delta - alpha",
+            "- - alpha * -beta + floor ceil gamma / (delta)",
+            "((((alpha))))-(beta-(gamma-(delta-1.125)))",
+            "1 - 2 - 3 * 4 / 5 / 6 + 7"
+    };
+    char* errors[] = { "2 +", "(2", "2)", "2 3", "-", "()", "* 2" };
+    SMEToken tokens[128];
+    SMEVarTable* table = new_SMEVarTable();
+    sme_var_set(table, "alpha", 3.4);
+    sme_var_set(table, "beta", 5.6);
+    sme_var_set(table, "gamma", -9.23);
+    sme_var_set(table, "delta", 2);
+
+    /* Same trees as the recursive parser, from the heap and from an arena */
+    SMEArena* arena = new_SMEArena(0);
+    for (int e = 0; e < (int)(sizeof(exprs) / sizeof(exprs[0])); e++) {
+        int count = sme_lex(exprs[e], strlen(exprs[e]), table, tokens, 128);
+        SMENode* expected = sme_parse_tokens(tokens, count, NULL);
+        SMENode* node = sme_parse_iterative(tokens, count, NULL);
+        CuAssertTrue(tc, test_same_tree(expected, node));
+        CuAssertDblEquals(tc, sme_eval_slots(expected, table->values), sme_eval_iterative(node, table->values), 0);
+        free_SMENode(node);
+        node = sme_parse_iterative(tokens, count, arena);
+        CuAssertTrue(tc, test_same_tree(expected, node));
+        sme_arena_reset(arena);
+        free_SMENode(expected);
+    }
+    free_SMEArena(arena);
+
+    for (int e = 0; e < (int)(sizeof(errors) / sizeof(errors[0])); e++) {
+        int count = sme_lex(errors[e], strlen(errors[e]), table, tokens, 128);
+        CuAssertPtrEquals(tc, NULL, sme_parse_iterative(tokens, count, NULL));
+        CuAssertPtrEquals(tc, NULL, sme_compile(errors[e], NULL));
+    }
+    free_SMEVarTable(table);
+
+    /* A million levels of parentheses, unary operators and right-nested subtractions */
+    int depth = 1000000;
+    char* nested[] = {
+            test_nest("(", "x", ")", depth),
+            test_nest("-", "x", "", depth),
+            test_nest("1-(", "1", ")", depth)
+    };
+    double results[] = { 2.5, 2.5, 1 };
+    for (int e = 0; e < 3; e++) {
+        SMEExpr* expr = sme_compile(nested[e], NULL);
+        CuAssertPtrNotNull(tc, expr);
+        if (expr->slots->count) sme_bind_name(expr, "x", 2.5);
+        CuAssertDblEquals(tc, results[e], sme_evaluate(expr), 0);
+        CuAssertDblEquals(tc, results[e], sme_eval_iterative(expr->root, expr->values), 0);
+        free_SMEExpr(expr);
+        free(nested[e]);
+    }
+}
+
+void test_optimize(CuTest* tc){
+    char* exprs[] = {
+            "+(2 * (4 / (2.2 + -5.4) - 22) * 2 + ceil(floor(33.4 + 2.4) * 2.4))",
+            "2 * (4 / (2.2 + -5.4) - 22) * a",
+            "a * 1 + 0 - 0 / (1 * b) * 1",
+            "- - a - - - b",
+            "floor(floor(a)) + ceil(floor(b)) + +(+a) - +(-b)",
+            "a / 4 + b / 3 + a / 0.125 + b / 0.5",
+            "0 + a * (3 - 3) + 1 * (b - 1)"
+    };
+    int nodes[][2] = { { 21, 1 }, { 12, 5 }, { 13, 7 }, { 7, 3 }, { 15, 11 }, { 15, 15 }, { 13, 9 } };
+    double row[] = { 3.4, -5.6 };
+    vars = new_SMEList();
+
+    for (int e = 0; e < (int)(sizeof(exprs) / sizeof(exprs[0])); e++) {
+        SMEOptimizeStats stats;
+        SMEExpr* expr = sme_compile(exprs[e], vars);
+        for (int j = 0; j < expr->slots->count; j++) {
+            sme_bind(expr, sme_slot(expr, j ? "b" : "a"), row[j]);
+        }
+        double value = sme_evaluate(expr);
+        sme_optimize_expr(expr, &stats);
+        CuAssertIntEquals(tc, nodes[e][0], stats.nodes_before);
+        CuAssertIntEquals(tc, nodes[e][1], stats.nodes_after);
+        CuAssertIntEquals(tc, stats.nodes_after, sme_count_nodes(expr->root));
+        CuAssertIntEquals(tc, stats.nodes_after + 1, expr->code->count);
+        CuAssertDblEquals(tc, value, sme_evaluate(expr), 0);
+        CuAssertDblEquals(tc, value, sme_eval_slots(expr->root, expr->values), 0);
+        free_SMEExpr(expr);
+    }
+
+    /* Adding 0 turns -0 into 0, so only the additions of -0 go */
+    char* zeros[] = { "a + 0", "0 + a", "a - -0", "a + -0", "-0 + a", "a - 0" };
+    int zero_nodes[] = { 3, 3, 3, 1, 1, 1 };
+    for (int e = 0; e < (int)(sizeof(zeros) / sizeof(zeros[0])); e++) {
+        SMEOptimizeStats stats;
+        SMEExpr* expr = sme_compile(zeros[e], vars);
+        sme_bind(expr, 0, -0.0);
+        double value = sme_evaluate(expr);
+        double optimized;
+        sme_optimize_expr(expr, &stats);
+        CuAssertIntEquals(tc, zero_nodes[e], stats.nodes_after);
+        optimized = sme_evaluate(expr);
+        CuAssertTrue(tc, !memcmp(&value, &optimized, sizeof(double)));
+        free_SMEExpr(expr);
+    }
+
+    /* Exact reciprocals only, and arena trees are left to the arena */
+    SMEArena* arena = new_SMEArena(0);
+    SMEVarTable* table = new_SMEVarTable();
+    SMEToken tokens[16];
+    int count = sme_lex("a / 4 / 3", 9, table, tokens, 16);
+    SMENode* root = sme_optimize(sme_parse_iterative(tokens, count, arena), arena, NULL);
+    CuAssertIntEquals(tc, SMEDiv, root->type);
+    CuAssertDblEquals(tc, 4.0 / 3, root->right->value, 0);
+    count = sme_lex("a / 4", 5, table, tokens, 16);
+    root = sme_optimize(sme_parse_iterative(tokens, count, arena), arena, NULL);
+    CuAssertIntEquals(tc, SMEMul, root->type);
+    CuAssertDblEquals(tc, 0.25, root->right->value, 0);
+    free_SMEVarTable(table);
+    free_SMEArena(arena);
+    free_SMEList(vars);
+}
+
+void test_dag(CuTest* tc){
+    char* exprs[] = {
+            "floor(a * b + c) * 2 - floor(a * b + c) / (a * b)",
+            "floor(b * a + c) + ceil(a * b + c)",
+            "-(a - b) - -(a - b) + (b - a)",
+            "2 * (4 / (2.2 + -5.4) - 22)"
+    };
+    int count = (int)(sizeof(exprs) / sizeof(exprs[0]));
+    double out[4];
+    SMEDag* dag = new_SMEDag();
+
+    for (int e = 0; e < count; e++) {
+        CuAssertIntEquals(tc, e, sme_dag_compile(dag, exprs[e], strlen(exprs[e])));
+    }
+    CuAssertIntEquals(tc, SME_LEX_ERROR, sme_dag_compile(dag, "a $ b", 5));
+    CuAssertIntEquals(tc, SME_PARSE_ERROR, sme_dag_compile(dag, "a b", 3));
+    CuAssertIntEquals(tc, count, dag->root_count);
+    CuAssertIntEquals(tc, 3, dag->slots->count);
+    /* Every repeat of a * b + c is the same node, across expressions and operand order */
+    CuAssertIntEquals(tc, 55, dag->tree_nodes);
+    CuAssertIntEquals(tc, 26, dag->count);
+
+    for (int k = 0; k < 3; k++) {
+        sme_var_set(dag->slots, "a", 3.4 * k - 1);
+        sme_var_set(dag->slots, "b", 5.6 - k);
+        sme_var_set(dag->slots, "c", -9.23 + k);
+        sme_dag_evaluate(dag, out);
+        for (int e = 0; e < count; e++) {
+            SMEExpr* expr = sme_compile(exprs[e], NULL);
+            for (int i = 0; i < expr->slots->count; i++) {
+                sme_bind(expr, i, dag->slots->values[sme_var_lookup(dag->slots, expr->slots->names[i])]);
+            }
+            CuAssertDblEquals(tc, sme_evaluate(expr), out[e], 0);
+            free_SMEExpr(expr);
+        }
+    }
+    free_SMEDag(dag);
+}
+
+void test_program(CuTest* tc){
+    double out[5];
+    SMEProgram* program = new_SMEProgram();
+    /* Defined before the outputs they read, the build puts them after */
+    CuAssertIntEquals(tc, 0, sme_program_define(program, "total", "net + tax"));
+    CuAssertIntEquals(tc, 1, sme_program_define(program, "tax", "net * rate"));
+    CuAssertIntEquals(tc, 2, sme_program_define(program, "net", "price * count - discount"));
+    CuAssertIntEquals(tc, 3, sme_program_define(program, "rounded", "floor(total * 100) / 100"));
+    CuAssertIntEquals(tc, 4, sme_program_define(program, "unrelated", "-(count)"));
+    CuAssertIntEquals(tc, SME_LEX_ERROR, sme_program_define(program, "tax", "1"));
+    CuAssertIntEquals(tc, SME_LEX_ERROR, sme_program_define(program, "floor", "1"));
+    CuAssertIntEquals(tc, SME_LEX_ERROR, sme_program_define(program, "a b", "1"));
+    CuAssertIntEquals(tc, 0, sme_program_build(program));
+    CuAssertIntEquals(tc, 2, program->order[0]);
+    CuAssertIntEquals(tc, 1, program->order[1]);
+    CuAssertIntEquals(tc, 0, program->order[2]);
+
+    sme_var_set(program->slots, "price", 2.5);
+    sme_var_set(program->slots, "count", 4);
+    sme_var_set(program->slots, "discount", 0.75);
+    sme_var_set(program->slots, "rate", 0.125);
+    CuAssertDblEquals(tc, -4, sme_program_evaluate(program, out), 0);
+    CuAssertDblEquals(tc, 9.25 * 1.125, out[0], 0);
+    CuAssertDblEquals(tc, 9.25 * 0.125, out[1], 0);
+    CuAssertDblEquals(tc, 9.25, out[2], 0);
+    CuAssertDblEquals(tc, 10.40, out[3], 0);
+    sme_var_set(program->slots, "count", 2);
+    sme_program_evaluate(program, out);
+    CuAssertDblEquals(tc, 4.25 * 1.125, out[0], 0);
+    free_SMEProgram(program);
+
+    program = new_SMEProgram();
+    sme_program_define(program, "a", "b + 1");
+    sme_program_define(program, "b", "c * 2");
+    sme_program_define(program, "c", "floor(a)");
+    CuAssertIntEquals(tc, SME_CYCLE_ERROR, sme_program_build(program));
+    CuAssertDblEquals(tc, 0, sme_program_evaluate(program, out), 0);
+    free_SMEProgram(program);
+
+    program = new_SMEProgram();
+    sme_program_define(program, "a", "a + 1");
+    CuAssertIntEquals(tc, SME_CYCLE_ERROR, sme_program_build(program));
+    CuAssertIntEquals(tc, 0, program->error_index);
+    free_SMEProgram(program);
+
+    program = new_SMEProgram();
+    sme_program_define(program, "a", "1");
+    sme_program_define(program, "b", "a +");
+    CuAssertIntEquals(tc, SME_PARSE_ERROR, sme_program_build(program));
+    CuAssertIntEquals(tc, 1, program->error_index);
+    free_SMEProgram(program);
+
+    program = new_SMEProgram();
+    CuAssertIntEquals(tc, 0, sme_program_build(program));
+    CuAssertDblEquals(tc, 0, sme_program_evaluate(program, NULL), 0);
+    free_SMEProgram(program);
+}
+
+void test_incremental(CuTest* tc){
+    char* exprs[] = { "a * b + c", "floor(c) * 2", "d - d" };
+    char* names[] = { "a", "b", "c", "d" };
+    double out[4];
+    double expected[3];
+    SMEDag* dag = new_SMEDag();
+    SMEDag* full = new_SMEDag();
+    for (int e = 0; e < 3; e++) {
+        sme_dag_compile(dag, exprs[e], strlen(exprs[e]));
+        sme_dag_compile(full, exprs[e], strlen(exprs[e]));
+    }
+    CuAssertIntEquals(tc, 10, dag->count);
+
+    /* The first update computes everything */
+    sme_dag_set(dag, sme_var_lookup(dag->slots, "c"), 5.2);
+    sme_dag_update(dag, out);
+    CuAssertIntEquals(tc, 10, dag->recomputed);
+    CuAssertDblEquals(tc, 5.2, out[0], 0);
+    CuAssertDblEquals(tc, 10, out[1], 0);
+
+    /* c and everything above it */
+    sme_dag_set(dag, sme_var_lookup(dag->slots, "c"), 6.5);
+    sme_dag_update(dag, out);
+    CuAssertIntEquals(tc, 4, dag->recomputed);
+    CuAssertIntEquals(tc, 6, dag->reused);
+    CuAssertDblEquals(tc, 12, out[1], 0);
+
+    /* floor(c) comes out the same, so floor(c) * 2 is reused */
+    sme_dag_set(dag, sme_var_lookup(dag->slots, "c"), 6.75);
+    sme_dag_update(dag, out);
+    CuAssertIntEquals(tc, 3, dag->recomputed);
+    CuAssertDblEquals(tc, 6.75, out[0], 0);
+
+    /* Nothing changed */
+    sme_dag_set(dag, sme_var_lookup(dag->slots, "c"), 6.75);
+    sme_dag_update(dag, out);
+    CuAssertIntEquals(tc, 0, dag->recomputed);
+    CuAssertIntEquals(tc, 10, dag->reused);
+
+    /* A variable toggled many times is listed once, unknown slots are turned away */
+    for (int i = 0; i < 1000; i++) CuAssertIntEquals(tc, 0, sme_dag_set(dag, sme_var_lookup(dag->slots, "c"), i % 2));
+    CuAssertIntEquals(tc, 1, dag->changed_count);
+    CuAssertIntEquals(tc, -1, sme_dag_set(dag, sme_var_lookup(dag->slots, "typo"), 1));
+    CuAssertIntEquals(tc, -1, sme_dag_set(dag, dag->slots->count, 1));
+    sme_dag_set(dag, sme_var_lookup(dag->slots, "c"), 6.75);
+    sme_dag_update(dag, out);
+    /* c is back where it was, only its own node is looked at */
+    CuAssertIntEquals(tc, 1, dag->recomputed);
+    CuAssertIntEquals(tc, 0, dag->changed_count);
+
+    /* Same results as evaluating everything, over a run of one or two changes at a time */
+    for (int v = 0; v < 4; v++) {
+        sme_var_set(full->slots, names[v], dag->slots->values[sme_var_lookup(dag->slots, names[v])]);
+    }
+    srand(7);
+    for (int k = 0; k < 200; k++) {
+        for (int j = 0; j < 1 + k % 2; j++) {
+            int v = rand() % 4;
+            double value = (rand() % 41 - 20) * 0.25;
+            sme_dag_set(dag, sme_var_lookup(dag->slots, names[v]), value);
+            sme_var_set(full->slots, names[v], value);
+        }
+        sme_dag_update(dag, out);
+        sme_dag_evaluate(full, expected);
+        CuAssertTrue(tc, dag->recomputed <= 6);
+        for (int e = 0; e < 3; e++) CuAssertDblEquals(tc, expected[e], out[e], 0);
+    }
+
+    /* Adding an expression starts over with a full evaluation */
+    CuAssertIntEquals(tc, 3, sme_dag_compile(dag, "e + a * b", 9));
+    sme_dag_update(dag, out);
+    CuAssertIntEquals(tc, dag->count, dag->recomputed);
+    free_SMEDag(full);
+    free_SMEDag(dag);
+}
+
+#define TEST_THREADS 8
+#define TEST_ROUNDS 20000
+
+typedef struct TestWorker {
+    SMEExpr* expr;
+    int index;
+    int failures;
+} TestWorker;
+
+/* Each thread binds its own values and checks every result against the formula in C */
+void* test_thread_worker(void* arg) {
+    TestWorker* worker = arg;
+    SMEContext* context = new_SMEContext(worker->expr);
+    int a = sme_slot(worker->expr, "a");
+    int b = sme_slot(worker->expr, "b");
+    double column[300];
+    double out[300];
+    const double* columns[2];
+    for (int i = 0; i < TEST_ROUNDS; i++) {
+        double x = worker->index * 1000.0 + i;
+        double y = (i % 13) + 0.5;
+        sme_context_bind(context, a, x);
+        sme_context_bind(context, b, y);
+        if (sme_evaluate_context(worker->expr, context) != x * y - (x - y) / 2) worker->failures++;
+    }
+    /* Batches use the context's bindings for columns left NULL */
+    for (int i = 0; i < 300; i++) column[i] = worker->index + i;
+    columns[a] = column;
+    columns[b] = NULL;
+    sme_context_bind(context, b, worker->index);
+    sme_evaluate_batch_context(worker->expr, context, columns, out, 300);
+    for (int i = 0; i < 300; i++) {
+        if (out[i] != column[i] * worker->index - (column[i] - worker->index) / 2) worker->failures++;
+    }
+    free_SMEContext(context);
+    return NULL;
+}
+
+void test_threads(CuTest* tc){
+    pthread_t threads[TEST_THREADS];
+    TestWorker workers[TEST_THREADS];
+    SMEExpr* expr = sme_compile("a * b - (a - b) / 2", NULL);
+    sme_bind(expr, 0, 3);
+    for (int i = 0; i < TEST_THREADS; i++) {
+        workers[i].expr = expr;
+        workers[i].index = i;
+        workers[i].failures = 0;
+        pthread_create(&threads[i], NULL, test_thread_worker, &workers[i]);
+    }
+    for (int i = 0; i < TEST_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+        CuAssertIntEquals(tc, 0, workers[i].failures);
+    }
+
+    /* The shared expression kept what was bound to it */
+    SMEContext* context = new_SMEContext(expr);
+    CuAssertDblEquals(tc, 3, context->values[0], 0);
+    CuAssertDblEquals(tc, -1.5, sme_evaluate_context(expr, context), 0);
+    free_SMEContext(context);
+    free_SMEExpr(expr);
+}
+
+typedef struct TestCacheWorker {
+    SMECache* cache;
+    int index;
+    int failures;
+} TestCacheWorker;
+
+/* Threads share the cache but not their variables, with a budget small enough to keep evicting */
+void* test_cache_worker(void* arg) {
+    TestCacheWorker* worker = arg;
+    SMEList* variables = new_SMEList();
+    SMEVar* a = new_SMEVar("a", worker->index);
+    char source[32];
+    append_SMEItem(variables, a);
+    for (int i = 0; i < TEST_ROUNDS / 4; i++) {
+        int n = (i * 7 + worker->index) % 48;
+        a->value = worker->index + i;
+        sprintf(source, "a * 2 + %d", n);
+        if (sme_cache_calc(worker->cache, source, variables) != a->value * 2 + n) worker->failures++;
+    }
+    free_SMEVar(a);
+    free_SMEList(variables);
+    return NULL;
+}
+
+void test_cache(CuTest* tc){
+    SMECache* cache = new_SMECache(1 << 20);
+    SMECacheStats stats;
+    SMEList* variables = new_SMEList();
+    SMEVar* a = new_SMEVar("a", 3);
+    append_SMEItem(variables, a);
+    append_SMEItem(variables, new_SMEVar("b", 4));
+
+    CuAssertDblEquals(tc, 11, sme_cache_calc(cache, "a + b * 2", variables), 0);
+    a->value = -1;
+    CuAssertDblEquals(tc, 7, sme_cache_calc(cache, "a + b * 2", variables), 0);
+    /* Names that are not in the list are 0 */
+    CuAssertDblEquals(tc, 5, sme_cache_calc(cache, "c + 5", variables), 0);
+    /* Sources that don't compile are not cached */
+    CuAssertDblEquals(tc, 0, sme_cache_calc(cache, "a + (b", variables), 0);
+    CuAssertDblEquals(tc, 0, sme_cache_calc(cache, "a + (b", variables), 0);
+    sme_cache_stats(cache, &stats);
+    CuAssertIntEquals(tc, 1, (int) stats.hits);
+    CuAssertIntEquals(tc, 4, (int) stats.misses);
+    CuAssertIntEquals(tc, 2, stats.entries);
+    CuAssertIntEquals(tc, 0, (int) stats.evictions);
+    CuAssertTrue(tc, stats.bytes > 0);
+    free_SMECache(cache);
+
+    /* Three sources landing in the same shard and a budget for two of them */
+    char sources[3][32];
+    int found = 0;
+    unsigned int shard = 0;
+    for (int n = 0; found < 3; n++) {
+        char source[32];
+        sprintf(source, "a + %d", n);
+        unsigned int hash = sme_hash_source(source, strlen(source));
+        if (found == 0) shard = (hash >> 24) % SME_CACHE_SHARDS;
+        if ((hash >> 24) % SME_CACHE_SHARDS == shard) strcpy(sources[found++], source);
+    }
+    cache = new_SMECache((size_t) 1 << 30);
+    sme_cache_calc(cache, sources[0], variables);
+    sme_cache_calc(cache, sources[1], variables);
+    sme_cache_stats(cache, &stats);
+    free_SMECache(cache);
+    cache = new_SMECache((stats.bytes + 8) * SME_CACHE_SHARDS);
+
+    a->value = 10;
+    sme_cache_calc(cache, sources[0], variables);
+    sme_cache_calc(cache, sources[1], variables);
+    /* Using the first makes the second the least recently used */
+    sme_cache_calc(cache, sources[0], variables);
+    CuAssertDblEquals(tc, 10 + atoi(sources[2] + 4), sme_cache_calc(cache, sources[2], variables), 0);
+    sme_cache_stats(cache, &stats);
+    CuAssertIntEquals(tc, 1, (int) stats.evictions);
+    CuAssertIntEquals(tc, 2, stats.entries);
+    CuAssertTrue(tc, stats.bytes <= cache->shards[shard].budget);
+    sme_cache_calc(cache, sources[0], variables);
+    sme_cache_calc(cache, sources[1], variables);
+    sme_cache_stats(cache, &stats);
+    CuAssertIntEquals(tc, 2, (int) stats.hits);
+    CuAssertIntEquals(tc, 4, (int) stats.misses);
+    free_SMECache(cache);
+
+    pthread_t threads[TEST_THREADS];
+    TestCacheWorker workers[TEST_THREADS];
+    cache = new_SMECache(16 * 1024);
+    for (int i = 0; i < TEST_THREADS; i++) {
+        workers[i].cache = cache;
+        workers[i].index = i;
+        workers[i].failures = 0;
+        pthread_create(&threads[i], NULL, test_cache_worker, &workers[i]);
+    }
+    for (int i = 0; i < TEST_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+        CuAssertIntEquals(tc, 0, workers[i].failures);
+    }
+    sme_cache_stats(cache, &stats);
+    CuAssertIntEquals(tc, TEST_THREADS * (TEST_ROUNDS / 4), (int) (stats.hits + stats.misses));
+    CuAssertTrue(tc, stats.evictions > 0);
+    CuAssertTrue(tc, stats.bytes <= cache->budget);
+    free_SMECache(cache);
+
+    for (int i = 0; i < variables->count; i++) free_SMEVar(variables->items[i]);
+    free_SMEList(variables);
+}
+
+void test_pool_count(void* arg, int worker, int chunk) {
+    int* counts = arg;
+    (void) worker;
+    __atomic_fetch_add(&counts[chunk], 1, __ATOMIC_RELAXED);
+}
+
+void test_pool(CuTest* tc){
+    int sizes[] = { 0, 1, 255, 1024, 1025, 100000 };
+    int threads[] = { 1, 3, 8 };
+    int counts[1000];
+    SMEExpr* expr = sme_compile("floor(a * b + x) - ceil(a * b + y) * (a - b) / (x + y)", NULL);
+    int count = expr->slots->count;
+    double* columns[4];
+    double* expected = malloc(sizeof(double) * 100000);
+    double* out = malloc(sizeof(double) * 100001);
+    for (int j = 0; j < count; j++) {
+        columns[j] = malloc(sizeof(double) * 100000);
+        for (int i = 0; i < 100000; i++) columns[j][i] = (i % 89) * 0.5 - j * 3.25;
+    }
+    sme_bind(expr, sme_slot(expr, "y"), 1.75);
+
+    for (int t = 0; t < 3; t++) {
+        SMEPool* pool = new_SMEPool(threads[t]);
+        CuAssertIntEquals(tc, threads[t], pool->threads);
+
+        /* Every chunk runs exactly once, run after run */
+        for (int run = 0; run < 20; run++) {
+            memset(counts, 0, sizeof(counts));
+            sme_pool_run(pool, run * 50, test_pool_count, counts);
+            for (int i = 0; i < 1000; i++) CuAssertIntEquals(tc, i < run * 50, counts[i]);
+        }
+
+        for (int s = 0; s < 6; s++) {
+            const double* view[4] = { columns[0], columns[1], columns[2], NULL };
+            sme_evaluate_batch(expr, view, expected, sizes[s]);
+            memset(out, 0, sizeof(double) * 100001);
+            sme_evaluate_batch_parallel(pool, expr, view, out, sizes[s]);
+            CuAssertTrue(tc, memcmp(expected, out, sizeof(double) * sizes[s]) == 0);
+            CuAssertDblEquals(tc, 0, out[sizes[s]], 0);
+        }
+        free_SMEPool(pool);
+    }
+
+    for (int j = 0; j < count; j++) free(columns[j]);
+    free(expected);
+    free(out);
+    free_SMEExpr(expr);
+}
+
+void test_compile_bulk(CuTest* tc){
+    char* exprs[] = {
+            "+(2 * (4 / (2.2 + -5.4) - 22) * 2 + ceil(floor(33.4 + 2.4) * 2.4))",
+            "a + b * x / y",
+            "a $ b",
+            "floor(a * b + x) - ceil(a * b + y)",
+            "(a + b",
+            "",
+            "a * (b + ) - c"
+    };
+    int errors[] = { 0, 0, SME_LEX_ERROR, 0, SME_PARSE_ERROR, 0, SME_PARSE_ERROR };
+    /* The bad character, the end of an unclosed parenthesis, the token after a missing operand */
+    int offsets[] = { -1, -1, 2, -1, 6, -1, 9 };
+    int count = 3500;
+    const char** sources = malloc(sizeof(char*) * count);
+    SMECompileResult* results = malloc(sizeof(SMECompileResult) * count);
+    for (int i = 0; i < count; i++) sources[i] = exprs[i % 7];
+
+    for (int t = 0; t < 2; t++) {
+        SMEPool* pool = t ? new_SMEPool(4) : NULL;
+        CuAssertIntEquals(tc, 1500, sme_compile_bulk(pool, sources, count, results));
+        for (int i = 0; i < count; i++) {
+            CuAssertIntEquals(tc, errors[i % 7], results[i].error);
+            CuAssertIntEquals(tc, offsets[i % 7], results[i].offset);
+            if (errors[i % 7]) {
+                CuAssertPtrEquals(tc, NULL, results[i].expr);
+                continue;
+            }
+            SMEExpr* expected = sme_compile(exprs[i % 7], NULL);
+            for (int j = 0; j < expected->slots->count; j++) {
+                sme_bind(expected, j, j + 0.5);
+                sme_bind(results[i].expr, sme_slot(results[i].expr, expected->slots->names[j]), j + 0.5);
+            }
+            CuAssertIntEquals(tc, expected->code->count, results[i].expr->code->count);
+            CuAssertDblEquals(tc, sme_evaluate(expected), sme_evaluate(results[i].expr), 0);
+            free_SMEExpr(expected);
+            free_SMEExpr(results[i].expr);
+        }
+        if (pool) free_SMEPool(pool);
+    }
+    free(sources);
+    free(results);
+}
+
+void test_jit(CuTest* tc){
+    char* exprs[] = {
+            "+(2 * (4 / (2.2 + -5.4) - 22) * 2 + ceil(floor(33.4 + 2.4) * 2.4))",
+            "a + b * x / y",
+            "floor(a * b + x) - ceil(a * b + y) * (a - b) / (x + y) + -a * -b",
+            "floor(a) + ceil(b) * 3 - floor(x) / ceil(y) + +(-a) - -(-b)",
+            "ceil(a) - floor(b) - ceil(x) - floor(y)",
+            "a - (b - (x - (y - (a - (b - (x - (y - (a - (b - (x - (y - (a - (b - (x - y))))))))))))))",
+            "1.5"
+    };
+    double zero = 0;
+    double specials[] = { 0, -0.0, 0.5, -0.5, 1, -1, 2.5, -2.5, 1e300, -1e300, 4503599627370495.5,
+                          -4503599627370495.5, 9007199254740993.0, 1 / zero, -1 / zero, zero / zero, 5e-324, -7.25 };
+    int count = (int)(sizeof(specials) / sizeof(specials[0]));
+    SMEVarTable* table = new_SMEVarTable();
+    SMEToken tokens[128];
+    double values[4];
+
+    for (int e = 0; e < (int)(sizeof(exprs) / sizeof(exprs[0])); e++) {
+        int token_count = sme_lex(exprs[e], strlen(exprs[e]), table, tokens, 128);
+        SMENode* root = sme_parse_iterative(tokens, token_count, NULL);
+        SMEJit* jit = new_SMEJit(root);
+#ifdef SME_JIT
+        /* Only the 16 deep chain is too deep for the registers */
+        CuAssertTrue(tc, (jit->function == NULL) == (e == 5));
+#endif
+        for (int i = 0; i < count * count; i++) {
+            SMEBits expected;
+            SMEBits actual;
+            for (int v = 0; v < 4; v++) values[v] = specials[(i / (v & 1 ? count : 1) + v * 5) % count];
+            expected.d = sme_eval_slots(root, values);
+            actual.d = sme_jit_evaluate(jit, values);
+            /* Bit for bit, any NaN counts as the same */
+            CuAssertTrue(tc, expected.u == actual.u || (expected.d != expected.d && actual.d != actual.d));
+        }
+        free_SMEJit(jit);
+        free_SMENode(root);
+    }
+    free_SMEVarTable(table);
+}
+
+void test_static(CuTest* tc){
+    double zero = 0;
+    double specials[] = { 0, -0.0, 0.5, -0.5, 1, -1, 2.5, -2.5, 1e300, -1e300, 4503599627370495.5,
+                          1 / zero, -1 / zero, zero / zero, 5e-324, -7.25, 3 };
+    int count = (int)(sizeof(specials) / sizeof(specials[0]));
+
+    CuAssertTrue(tc, sme_static_count > 0);
+    for (int f = 0; f < sme_static_count; f++) {
+        const SMEStaticFormula* formula = &sme_static_formulas[f];
+        SMEExpr* expr = sme_compile((char*) formula->source, NULL);
+        CuAssertPtrNotNull(tc, expr);
+        /* Both number the names in order of first appearance */
+        CuAssertIntEquals(tc, expr->slots->count, formula->slots);
+        for (int i = 0; i < count * count; i++) {
+            SMEBits expected;
+            SMEBits actual;
+            for (int v = 0; v < formula->slots; v++) sme_bind(expr, v, specials[(i / (v & 1 ? count : 1) + v * 5) % count]);
+            expected.d = sme_evaluate(expr);
+            actual.d = formula->function(expr->values);
+            CuAssertTrue(tc, expected.u == actual.u || (expected.d != expected.d && actual.d != actual.d));
+        }
+        free_SMEExpr(expr);
+    }
+}
+
+void test_image(CuTest* tc){
+    SMEExpr* expr = sme_compile("floor(rate * hours) - fee / 2 + rate", NULL);
+    size_t size = sme_image_write(expr, NULL);
+    /* Doubles keep the bytes 8 byte aligned */
+    double* buffer = malloc(size + 8);
+    double values[3] = { 12.5, 3.3, 4 };
+    CuAssertIntEquals(tc, (int) size, (int) sme_image_write(expr, buffer));
+
+    SMEImage* image = sme_image_open(buffer, size);
+    CuAssertPtrNotNull(tc, image);
+    CuAssertIntEquals(tc, 3, image->slot_count);
+    CuAssertStrEquals(tc, "hours", sme_image_name(image, 1));
+    CuAssertIntEquals(tc, 2, sme_image_slot(image, "fee"));
+    CuAssertIntEquals(tc, -1, sme_image_slot(image, "tax"));
+    for (int i = 0; i < 3; i++) sme_bind(expr, i, values[i]);
+    CuAssertDblEquals(tc, sme_evaluate(expr), sme_image_evaluate(image, values), 0);
+    CuAssertDblEquals(tc, 51.5, sme_image_evaluate(image, values), 0);
+    free_SMEImage(image);
+
+    char path[64];
+    sprintf(path, "/tmp/sme_image_%d", (int) getpid());
+    CuAssertIntEquals(tc, 0, sme_image_save(expr, path));
+    image = sme_image_map(path);
+    CuAssertPtrNotNull(tc, image);
+    CuAssertDblEquals(tc, 51.5, sme_image_evaluate(image, values), 0);
+    free_SMEImage(image);
+    remove(path);
+    CuAssertPtrEquals(tc, NULL, sme_image_map(path));
+    CuAssertIntEquals(tc, SME_IO_ERROR, sme_image_save(expr, "/nonexistent/sme.image"));
+
+    /* Damaged images are turned away */
+    SMEImageHeader* header = (SMEImageHeader*) buffer;
+    SMEInstr* instrs = (SMEInstr*) (header + 1);
+    char* bytes = (char*) buffer;
+    CuAssertPtrEquals(tc, NULL, sme_image_open(buffer, size - 1));
+    CuAssertPtrEquals(tc, NULL, sme_image_open(bytes + 4, size));
+    memmove(bytes + 1, bytes, size);
+    CuAssertPtrEquals(tc, NULL, sme_image_open(bytes + 1, size));
+    sme_image_write(expr, buffer);
+    header->version++;
+    CuAssertPtrEquals(tc, NULL, sme_image_open(buffer, size));
+    header->version--;
+    header->byte_order = 0x04030201;
+    CuAssertPtrEquals(tc, NULL, sme_image_open(buffer, size));
+    header->byte_order = SME_IMAGE_BYTE_ORDER;
+    bytes[size - 1] = 'x';
+    CuAssertPtrEquals(tc, NULL, sme_image_open(buffer, size));
+    bytes[size - 1] = '\0';
+    instrs[0].arg = 3;
+    CuAssertPtrEquals(tc, NULL, sme_image_open(buffer, size));
+    instrs[0].arg = 0;
+    instrs[0].op = SMEOpCall + 1;
+    CuAssertPtrEquals(tc, NULL, sme_image_open(buffer, size));
+    /* Swapping the last operator and End leaves too much on the stack */
+    instrs[0].op = SMEOpVar;
+    SMEInstr last = instrs[header->instr_count - 2];
+    instrs[header->instr_count - 2] = instrs[header->instr_count - 1];
+    instrs[header->instr_count - 1] = last;
+    CuAssertPtrEquals(tc, NULL, sme_image_open(buffer, size));
+    instrs[header->instr_count - 1] = instrs[header->instr_count - 2];
+    instrs[header->instr_count - 2] = last;
+    image = sme_image_open(buffer, size);
+    CuAssertPtrNotNull(tc, image);
+    free_SMEImage(image);
+
+    free(buffer);
+    free_SMEExpr(expr);
+}
+
+void test_stats(CuTest* tc){
+#ifdef SME_STATS
+    SMEList* variables = new_SMEList();
+    append_SMEItem(variables, new_SMEVar("a", 1.5));
+    append_SMEItem(variables, new_SMEVar("b", 4));
+    SMEArena* arena = new_SMEArena(0);
+
+    CuAssertDblEquals(tc, 6, sme_calc_arena("floor(a * 2) + (b - 1)", variables, arena), 0);
+    const SMEStats* stats = sme_stats_last();
+    CuAssertPtrNotNull(tc, stats);
+    CuAssertIntEquals(tc, 12, stats->tokens);
+    CuAssertIntEquals(tc, 8, stats->nodes);
+    /* Add, floor, mul, a */
+    CuAssertIntEquals(tc, 4, stats->depth);
+    CuAssertIntEquals(tc, 2, stats->lookups);
+    CuAssertTrue(tc, stats->tokenize > 0 && stats->parse > 0 && stats->eval > 0);
+    CuAssertTrue(tc, stats->lookup <= stats->tokenize);
+    CuAssertTrue(tc, stats->total >= stats->tokenize + stats->parse + stats->eval + stats->free);
+    /* The first call grew the arena, the same expression again needs no memory */
+    sme_calc_arena("floor(a * 2) + (b - 1)", variables, arena);
+    CuAssertIntEquals(tc, 0, (int) stats->allocs);
+
+    SMEVarTable* table = new_SMEVarTable();
+    sme_var_set(table, "x", 3);
+    CuAssertDblEquals(tc, 1, sme_calc_table("-(x - 4)", table), 0);
+    CuAssertIntEquals(tc, 6, stats->tokens);
+    CuAssertIntEquals(tc, 4, stats->nodes);
+    CuAssertIntEquals(tc, 3, stats->depth);
+    CuAssertIntEquals(tc, 1, stats->lookups);
+    CuAssertTrue(tc, stats->allocs > 0);
+    free_SMEVarTable(table);
+    free_SMEArena(arena);
+    for (int i = 0; i < variables->count; i++) free_SMEVar(variables->items[i]);
+    free_SMEList(variables);
+#else
+    CuAssertPtrEquals(tc, NULL, (void*) sme_stats_last());
+#endif
+}
+
+/* Error of value in units in the last place of the double nearest to the exact result */
+double test_ulps(double value, long double exact) {
+    double nearest = (double) exact;
+    double ulp = nextafter(fabs(nearest), INFINITY) - fabs(nearest);
+    if (value == exact || (value != value && exact != exact)) return 0;
+    return (double) fabsl((long double) value - exact) / ulp;
+}
+
+/* The same bits, any NaN counts as the same */
+int test_same(double a, double b) {
+    SMEBits x;
+    SMEBits y;
+    x.d = a;
+    y.d = b;
+    return x.u == y.u || (a != a && b != b);
+}
+
+void test_functions(CuTest* tc){
+    char* exprs[] = {
+            "sqrt(a * a + b * b)",
+            "pow(a, 2) - pow(b, 0.5) + exp(-abs(a))",
+            "max(a, min(b, 3)) * round(a / b)",
+            "sin(a) * cos(b) + tan(a / 4) - log(abs(b) + 1)",
+            "floor(pow(2, max(a, b))) / 2 * -sqrt(4)",
+            "min(max(a, b), max(b, a)) - pow(pow(a, 2), 0.5)"
+    };
+    double rows[][2] = { { 3, 4 }, { -1.5, 0.25 }, { 0.1, -7 }, { 2.5, 2.5 }, { -0.0, 1e-3 } };
+    char* errors[] = { "pow(2)", "sqrt(1, 2)", "min()", "sqrt 4", "sqrt(", "max(1, 2", "1, 2", "(1, 2)",
+                       "sin(1)(2)", "max(1,, 2)", "abs(1,)" };
+    int expr_count = (int)(sizeof(exprs) / sizeof(exprs[0]));
+    int row_count = (int)(sizeof(rows) / sizeof(rows[0]));
+    SMEVarTable* table = new_SMEVarTable();
+    SMEDag* dag = new_SMEDag();
+    SMEToken tokens[128];
+    double out[8];
+
+    CuAssertIntEquals(tc, SMEFnPow, sme_function_find("pow", 3));
+    CuAssertIntEquals(tc, -1, sme_function_find("power", 5));
+    CuAssertIntEquals(tc, 2, sme_function(SMEFnMax)->arity);
+    CuAssertPtrEquals(tc, NULL, (void*) sme_function(SMEFnCount));
+    CuAssertDblEquals(tc, 3, sme_calc_table("round(2.5) + round(-0.4)", table), 0);
+    CuAssertDblEquals(tc, -3, sme_round(-2.5), 0);
+
+    for (int e = 0; e < expr_count; e++) {
+        CuAssertIntEquals(tc, e, sme_dag_compile(dag, exprs[e], strlen(exprs[e])));
+    }
+    for (int r = 0; r < row_count; r++) {
+        double a = rows[r][0];
+        double b = rows[r][1];
+        sme_var_set(table, "a", a);
+        sme_var_set(table, "b", b);
+        sme_var_set(dag->slots, "a", a);
+        sme_var_set(dag->slots, "b", b);
+        sme_dag_evaluate(dag, out);
+        for (int e = 0; e < expr_count; e++) {
+            /* Every way of evaluating an expression gets the same bits */
+            SMEExpr* expr = sme_compile(exprs[e], NULL);
+            CuAssertPtrNotNull(tc, expr);
+            sme_bind_name(expr, "a", a);
+            sme_bind_name(expr, "b", b);
+            double value = sme_evaluate(expr);
+            CuAssertTrue(tc, test_same(value, sme_eval_slots(expr->root, expr->values)));
+            CuAssertTrue(tc, test_same(value, sme_eval_iterative(expr->root, expr->values)));
+            CuAssertTrue(tc, test_same(value, sme_calc_table(exprs[e], table)));
+            CuAssertTrue(tc, test_same(value, out[e]));
+            SMEJit* jit = new_SMEJit(expr->root);
+            CuAssertPtrEquals(tc, NULL, (void*) jit->function);
+            CuAssertTrue(tc, test_same(value, sme_jit_evaluate(jit, expr->values)));
+            free_SMEJit(jit);
+            SMEStream* stream = new_SMEStream(table);
+            sme_stream_feed(stream, exprs[e], strlen(exprs[e]));
+            CuAssertIntEquals(tc, 0, sme_stream_end(stream));
+            CuAssertTrue(tc, test_same(value, stream->result));
+            free_SMEStream(stream);
+            free_SMEExpr(expr);
+        }
+    }
+    /* Only the calls that read b and what is above them */
+    sme_dag_set(dag, sme_var_lookup(dag->slots, "b"), 4);
+    sme_dag_update(dag, out);
+    sme_dag_set(dag, sme_var_lookup(dag->slots, "a"), 3);
+    sme_dag_update(dag, out);
+    CuAssertDblEquals(tc, 5, out[0], 0);
+    CuAssertDblEquals(tc, -4, out[4], 0);
+    free_SMEDag(dag);
+
+    for (int e = 0; e < (int)(sizeof(errors) / sizeof(errors[0])); e++) {
+        int count = sme_lex(errors[e], strlen(errors[e]), table, tokens, 128);
+        CuAssertPtrEquals(tc, NULL, sme_compile(errors[e], NULL));
+        /* The recursive parser is lenient about everything but the calls themselves */
+        if (e < 6) CuAssertPtrEquals(tc, NULL, sme_parse_tokens(tokens, count, NULL));
+        SMEStream* stream = new_SMEStream_code();
+        sme_stream_feed(stream, errors[e], strlen(errors[e]));
+        CuAssertIntEquals(tc, SME_PARSE_ERROR, sme_stream_end(stream));
+        free_SMEStream(stream);
+    }
+    free_SMEVarTable(table);
+
+    /* Pure calls on constants fold, the ones reading a variable stay */
+    SMEOptimizeStats stats;
+    SMEExpr* expr = sme_compile("sqrt(4) + max(pow(2, 3), 1, ) * a", NULL);
+    CuAssertPtrEquals(tc, NULL, expr);
+    expr = sme_compile("sqrt(4) + max(pow(2, 3), 1) * sin(a)", NULL);
+    sme_optimize_expr(expr, &stats);
+    CuAssertIntEquals(tc, 11, stats.nodes_before);
+    CuAssertIntEquals(tc, 6, stats.nodes_after);
+    CuAssertIntEquals(tc, 3, stats.folded);
+    sme_bind(expr, 0, 1);
+    CuAssertDblEquals(tc, 2 + 8 * sme_sin(1), sme_evaluate(expr), 0);
+
+    /* Calls survive an image, a function the library doesn't have is turned away */
+    size_t size = sme_image_write(expr, NULL);
+    double* buffer = malloc(size);
+    sme_image_write(expr, buffer);
+    SMEImage* image = sme_image_open(buffer, size);
+    CuAssertPtrNotNull(tc, image);
+    double values[] = { 1 };
+    CuAssertDblEquals(tc, sme_evaluate(expr), sme_image_evaluate(image, values), 0);
+    free_SMEImage(image);
+    SMEInstr* instrs = (SMEInstr*) ((SMEImageHeader*) buffer + 1);
+    CuAssertIntEquals(tc, SMEOpCall, instrs[3].op);
+    instrs[3].arg = SMEFnCount;
+    CuAssertPtrEquals(tc, NULL, sme_image_open(buffer, size));
+    /* pow instead of sin leaves one value too few for the add */
+    instrs[3].arg = SMEFnPow;
+    CuAssertPtrEquals(tc, NULL, sme_image_open(buffer, size));
+    free(buffer);
+    free_SMEExpr(expr);
+
+    SMEProgram* program = new_SMEProgram();
+    CuAssertIntEquals(tc, SME_LEX_ERROR, sme_program_define(program, "sqrt", "1"));
+    CuAssertIntEquals(tc, 0, sme_program_define(program, "side", "sqrt(area)"));
+    CuAssertIntEquals(tc, 1, sme_program_define(program, "area", "pow(3, 2) + 7"));
+    CuAssertIntEquals(tc, 0, sme_program_build(program));
+    sme_program_evaluate(program, out);
+    CuAssertDblEquals(tc, 4, out[0], 0);
+    free_SMEProgram(program);
+}
+
+/* Uniform in [low, high), the same sequence every run */
+double test_random(unsigned long long* state, double low, double high) {
+    *state = *state * 6364136223846793005ULL + 1442695040888963407ULL;
+    return low + (high - low) * (double) (*state >> 11) / 9007199254740992.0;
+}
+
+void test_math(CuTest* tc){
+    char* names[] = { "scalar", "sse2", "avx2", "avx512" };
+    char* exprs[] = { "sqrt(a)", "exp(a)", "log(a)", "sin(a)", "cos(a)", "tan(a)", "round(a)", "abs(a)",
+                      "pow(a, b)", "min(a, b)", "max(a, b)" };
+    double specials[] = { 0.0, -0.0, 0.5, -0.5, 1, -1, 2.5, -2.5, 3, 1e-3, 709.7, -745.2, 710, -746,
+                          1e300, -1e300, 1.6e6, 2e6, 1e22, 4503599627370495.5, 1.0 / 0.0, -1.0 / 0.0,
+                          0.0 / 0.0, 5e-324, 2.2250738585072014e-308 };
+    int count = (int)(sizeof(specials) / sizeof(specials[0]));
+    int rows = count * count + 4096;
+    unsigned long long state = 1;
+    double worst[6] = { 0 };
+    double* a = malloc(sizeof(double) * rows);
+    double* b = malloc(sizeof(double) * rows);
+    double* out = malloc(sizeof(double) * rows);
+    double* expected = malloc(sizeof(double) * rows);
+
+    /* Against long double libm on random inputs, in ulps */
+    for (int i = 0; i < 20000; i++) {
+        double x = test_random(&state, -700, 700);
+        double t = ldexp(test_random(&state, 1, 2), (int) test_random(&state, -1000, 1000));
+        double r = test_random(&state, -1e5, 1e5);
+        double p = test_random(&state, 1e-3, 100);
+        double y = test_random(&state, -50, 50);
+        double checks[] = { test_ulps(sme_exp(x), expl(x)), test_ulps(sme_log(t), logl(t)),
+                            test_ulps(sme_sin(r), sinl(r)), test_ulps(sme_cos(r), cosl(r)),
+                            test_ulps(sme_pow(p, y), powl(p, y)), test_ulps(sme_tan(r / 1e4), tanl(r / 1e4)) };
+        for (int k = 0; k < 6; k++) worst[k] = checks[k] > worst[k] ? checks[k] : worst[k];
+        CuAssertDblEquals(tc, sqrt(t), sme_sqrt(t), 0);
+    }
+    for (int k = 0; k < 4; k++) CuAssertTrue(tc, worst[k] < 1);
+    CuAssertTrue(tc, worst[4] < 1.1);
+    CuAssertTrue(tc, worst[5] < 2.1);
+    /* C99 special cases */
+    CuAssertDblEquals(tc, 1, sme_pow(0.0 / 0.0, 0), 0);
+    CuAssertDblEquals(tc, 1, sme_pow(-1, 1.0 / 0.0), 0);
+    CuAssertTrue(tc, sme_pow(-0.0, -3) == -1.0 / 0.0);
+    CuAssertDblEquals(tc, 0, sme_pow(-1.0 / 0.0, -0.5), 0);
+    CuAssertDblEquals(tc, -8, sme_pow(-2, 3), 0);
+    CuAssertTrue(tc, sme_pow(-2, 0.5) != sme_pow(-2, 0.5));
+    CuAssertTrue(tc, sme_log(-1) != sme_log(-1));
+    CuAssertTrue(tc, sme_log(0) == -1.0 / 0.0);
+    CuAssertDblEquals(tc, 0, sme_exp(-1.0 / 0.0), 0);
+
+    for (int i = 0; i < rows; i++) {
+        a[i] = i < count * count ? specials[i / count] : test_random(&state, -20, 20);
+        b[i] = i < count * count ? specials[i % count] : test_random(&state, -20, 20);
+        if (i >= count * count && i % 2) a[i] = sme_abs(a[i]);
+    }
+    const double* columns[] = { a, b };
+    vars = new_SMEList();
+    for (int e = 0; e < (int)(sizeof(exprs) / sizeof(exprs[0])); e++) {
+        SMEExpr* expr = sme_compile(exprs[e], vars);
+        for (int i = 0; i < rows; i++) {
+            sme_bind(expr, 0, a[i]);
+            if (expr->slots->count > 1) sme_bind(expr, 1, b[i]);
+            expected[i] = sme_evaluate(expr);
+        }
+        /* The vector cores take the scalar steps, so they match bit for bit too */
+        for (int k = 0; k < 4; k++) {
+            if (sme_select_kernels(names[k])) continue;
+            sme_evaluate_batch(expr, columns, out, rows);
+            CuAssertTrue(tc, !memcmp(expected, out, sizeof(double) * rows));
+        }
+        free_SMEExpr(expr);
+    }
+    sme_select_kernels(sme_detect_kernels()->name);
+    free_SMEList(vars);
+    free(a);
+    free(b);
+    free(out);
+    free(expected);
+}
+
+/* Functions test_register hands to the library */
+double test_lerp(const double* args) {
+    return args[0] + (args[1] - args[0]) * args[2];
+}
+
+void test_lerp_batch(double* out, const double* const* args, int n) {
+    for (int i = 0; i < n; i++) out[i] = args[0][i] + (args[1][i] - args[0][i]) * args[2][i];
+}
+
+double test_twice(const double* args) {
+    return args[0] * 2;
+}
+
+int test_ticks = 0;
+
+double test_tick(const double* args) {
+    return args[0] + ++test_ticks;
+}
+
+void test_register(CuTest* tc){
+    char* names[] = { "scalar", "sse2", "avx2", "avx512" };
+    double out[SME_BLOCK_SIZE * 3];
+    double a[SME_BLOCK_SIZE * 3];
+    double b[SME_BLOCK_SIZE * 3];
+    double expected[SME_BLOCK_SIZE * 3];
+    int rows = SME_BLOCK_SIZE * 3 - 5;
+
+    int lerp = sme_function_register("lerp", 3, 1, test_lerp, test_lerp_batch);
+    int twice = sme_function_register("twice", 1, 1, test_twice, NULL);
+    int tick = sme_function_register("tick", 1, 0, test_tick, NULL);
+    CuAssertIntEquals(tc, SMEFnCount, lerp);
+    CuAssertIntEquals(tc, lerp + 1, twice);
+    CuAssertIntEquals(tc, twice + 1, tick);
+    CuAssertIntEquals(tc, twice, sme_function_find("twice", 5));
+    CuAssertIntEquals(tc, 3, sme_function(lerp)->arity);
+    CuAssertIntEquals(tc, SME_LEX_ERROR, sme_function_register("sqrt", 1, 1, test_twice, NULL));
+    CuAssertIntEquals(tc, SME_LEX_ERROR, sme_function_register("floor", 1, 1, test_twice, NULL));
+    CuAssertIntEquals(tc, SME_LEX_ERROR, sme_function_register("lerp", 1, 1, test_twice, NULL));
+    CuAssertIntEquals(tc, SME_LEX_ERROR, sme_function_register("x2", 1, 1, test_twice, NULL));
+    CuAssertIntEquals(tc, SME_LEX_ERROR, sme_function_register("", 1, 1, test_twice, NULL));
+    CuAssertIntEquals(tc, -1, sme_function_register("none", 0, 1, test_twice, NULL));
+    CuAssertIntEquals(tc, -1, sme_function_register("many", SME_MAX_ARGS + 1, 1, test_twice, NULL));
+    CuAssertIntEquals(tc, -1, sme_function_register("null", 1, 1, NULL, NULL));
+    CuAssertIntEquals(tc, -1, sme_function_find("none", 4));
+
+    /* Every path, the batch form and the row by row fallback under every kernel set */
+    char* expr_text = "lerp(a, b, 0.25) * twice(b) - sqrt(abs(a))";
+    SMEVarTable* table = new_SMEVarTable();
+    sme_var_set(table, "a", 2);
+    sme_var_set(table, "b", 6);
+    double value = (2 + 4 * 0.25) * 12 - sme_sqrt(2);
+    CuAssertDblEquals(tc, value, sme_calc_table(expr_text, table), 0);
+    SMEExpr* expr = sme_compile(expr_text, NULL);
+    CuAssertPtrNotNull(tc, expr);
+    sme_bind_name(expr, "a", 2);
+    sme_bind_name(expr, "b", 6);
+    CuAssertDblEquals(tc, value, sme_evaluate(expr), 0);
+    CuAssertDblEquals(tc, value, sme_eval_slots(expr->root, expr->values), 0);
+    CuAssertDblEquals(tc, value, sme_eval_iterative(expr->root, expr->values), 0);
+    SMEStream* stream = new_SMEStream(table);
+    sme_stream_feed(stream, expr_text, strlen(expr_text));
+    CuAssertIntEquals(tc, 0, sme_stream_end(stream));
+    CuAssertDblEquals(tc, value, stream->result, 0);
+    free_SMEStream(stream);
+    CuAssertPtrEquals(tc, NULL, sme_compile("lerp(1, 2)", NULL));
+
+    for (int i = 0; i < rows; i++) {
+        a[i] = i * 0.5 - 7;
+        b[i] = 3 - i * 0.25;
+        sme_bind(expr, 0, a[i]);
+        sme_bind(expr, 1, b[i]);
+        expected[i] = sme_evaluate(expr);
+    }
+    const double* columns[] = { a, b };
+    for (int k = 0; k < 4; k++) {
+        if (sme_select_kernels(names[k])) continue;
+        sme_evaluate_batch(expr, columns, out, rows);
+        CuAssertTrue(tc, !memcmp(expected, out, sizeof(double) * rows));
+    }
+    sme_select_kernels(sme_detect_kernels()->name);
+
+    /* Images only carry built in functions */
+    CuAssertIntEquals(tc, 0, (int) sme_image_write(expr, NULL));
+    CuAssertIntEquals(tc, SME_IO_ERROR, sme_image_save(expr, "register.smei"));
+    free_SMEExpr(expr);
+
+    /* Pure calls fold, impure ones run on every evaluation */
+    SMEOptimizeStats stats;
+    expr = sme_compile("twice(lerp(0, 4, 0.5)) + tick(0)", NULL);
+    sme_optimize_expr(expr, &stats);
+    CuAssertIntEquals(tc, 2, stats.folded);
+    test_ticks = 0;
+    CuAssertDblEquals(tc, 5, sme_evaluate(expr), 0);
+    CuAssertDblEquals(tc, 6, sme_evaluate(expr), 0);
+    free_SMEExpr(expr);
+
+    /* The DAG shares twice(a) but keeps both tick(a), and updates call them again */
+    SMEDag* dag = new_SMEDag();
+    sme_dag_compile(dag, "twice(a) + tick(a)", 18);
+    sme_dag_compile(dag, "twice(a) - tick(a)", 18);
+    CuAssertIntEquals(tc, 6, dag->count);
+    sme_var_set(dag->slots, "a", 1);
+    test_ticks = 0;
+    sme_dag_update(dag, out);
+    CuAssertDblEquals(tc, 4, out[0], 0);
+    CuAssertDblEquals(tc, -1, out[1], 0);
+    sme_dag_update(dag, out);
+    CuAssertDblEquals(tc, 6, out[0], 0);
+    CuAssertDblEquals(tc, -3, out[1], 0);
+    CuAssertIntEquals(tc, 4, dag->recomputed);
+    free_SMEDag(dag);
+
+    SMEProgram* program = new_SMEProgram();
+    CuAssertIntEquals(tc, SME_LEX_ERROR, sme_program_define(program, "lerp", "1"));
+    CuAssertIntEquals(tc, 0, sme_program_define(program, "mid", "lerp(low, high, 0.5)"));
+    CuAssertIntEquals(tc, 1, sme_program_define(program, "low", "twice(2)"));
+    CuAssertIntEquals(tc, 2, sme_program_define(program, "high", "8"));
+    CuAssertIntEquals(tc, 0, sme_program_build(program));
+    sme_program_evaluate(program, out);
+    CuAssertDblEquals(tc, 6, out[0], 0);
+    free_SMEProgram(program);
+    free_SMEVarTable(table);
+}
+
 /* Add all the tests to the test suite. */
 CuSuite* test_suite() {
     CuSuite* suite = CuSuiteNew();
@@ -96,11 +1559,35 @@ CuSuite* test_suite() {
     SUITE_ADD_TEST(suite, test_parser);
     SUITE_ADD_TEST(suite, test_evaluator);
     SUITE_ADD_TEST(suite, test_variables);
+    SUITE_ADD_TEST(suite, test_compile);
+    SUITE_ADD_TEST(suite, test_bytecode);
+    SUITE_ADD_TEST(suite, test_batch);
+    SUITE_ADD_TEST(suite, test_kernels);
+    SUITE_ADD_TEST(suite, test_arena);
+    SUITE_ADD_TEST(suite, test_var_table);
+    SUITE_ADD_TEST(suite, test_lexer);
+    SUITE_ADD_TEST(suite, test_stream);
+    SUITE_ADD_TEST(suite, test_iterative);
+    SUITE_ADD_TEST(suite, test_optimize);
+    SUITE_ADD_TEST(suite, test_dag);
+    SUITE_ADD_TEST(suite, test_program);
+    SUITE_ADD_TEST(suite, test_incremental);
+    SUITE_ADD_TEST(suite, test_threads);
+    SUITE_ADD_TEST(suite, test_pool);
+    SUITE_ADD_TEST(suite, test_compile_bulk);
+    SUITE_ADD_TEST(suite, test_jit);
+    SUITE_ADD_TEST(suite, test_static);
+    SUITE_ADD_TEST(suite, test_cache);
+    SUITE_ADD_TEST(suite, test_image);
+    SUITE_ADD_TEST(suite, test_stats);
+    SUITE_ADD_TEST(suite, test_functions);
+    SUITE_ADD_TEST(suite, test_math);
+    SUITE_ADD_TEST(suite, test_register);
     return suite;
 }
 
 /* Runs all the tests and prints the result. */
-void all_tests() {
+int all_tests() {
     CuString *output = CuStringNew();
     CuSuite *suite = CuSuiteNew();
 
@@ -109,10 +1596,10 @@ void all_tests() {
     CuSuiteRun(suite);
     CuSuiteDetails(suite, output);
     printf("%s\n", output->buffer);
+    return suite->failCount;
 }
 
 
 int main(void) {
-    all_tests();
-    return 0;
+    return all_tests() ? 1 : 0;
 }
\ No newline at end of file
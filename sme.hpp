@@ -0,0 +1,368 @@
+#ifndef SME_HPP
+#define SME_HPP
+
+/* Parses sme expressions at compile time into expression template types (C++20). The grammar is
+ * the one of sme_expr, sme_term and sme_factor: + and - associate left, * and / associate right,
+ * unary -, +, floor and ceil bind to the next factor. Names become slots in order of first
+ * appearance, like sme_compile assigns them, and every operation rounds like the runtime does.
+ * Function calls are left to the runtime. */
+
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+
+namespace sme {
+
+
+/* LITERAL */
+template <std::size_t N>
+struct literal {
+    char text[N];
+
+    constexpr literal(const char (&source)[N]) {
+        for (std::size_t i = 0; i < N; i++) text[i] = source[i];
+    }
+
+    constexpr std::size_t size() const {
+        return N - 1;
+    }
+};
+
+
+/* NODES */
+enum class kind {
+    num,
+    var,
+    add,
+    sub,
+    mul,
+    div,
+    neg,
+    pos,
+    floor,
+    ceil
+};
+
+namespace detail {
+
+struct node {
+    kind type = kind::num;
+    double value = 0;
+    int slot = 0;
+    int left = -1;
+    int right = -1;
+};
+
+struct name {
+    std::size_t start = 0;
+    std::size_t length = 0;
+};
+
+/* Every node takes at least one character, so N nodes are always enough */
+template <std::size_t N>
+struct tree {
+    node nodes[N];
+    name names[N];
+    int count = 0;
+    int slots = 0;
+    int root = -1;
+};
+
+
+/* ROUNDING */
+constexpr std::uint64_t sign_bit = 1ULL << 63;
+constexpr double two_52 = 4503599627370496.0;
+
+constexpr double abs(double value) {
+    return std::bit_cast<double>(std::bit_cast<std::uint64_t>(value) & ~sign_bit);
+}
+
+constexpr double keep_sign(double value, double from) {
+    return std::bit_cast<double>(std::bit_cast<std::uint64_t>(value) | (std::bit_cast<std::uint64_t>(from) & sign_bit));
+}
+
+/* The same steps as sme_floor and sme_ceil, so both agree to the last bit */
+constexpr double floor(double value) {
+    if (!(abs(value) < two_52)) return value;
+    double res = (double) (long long) value;
+    if (res > value) res -= 1;
+    return keep_sign(res, value);
+}
+
+constexpr double ceil(double value) {
+    if (!(abs(value) < two_52)) return value;
+    double res = (double) (long long) value;
+    if (res < value) res += 1;
+    return keep_sign(res, value);
+}
+
+
+/* PARSER */
+constexpr double pow10[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+constexpr bool is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f';
+}
+
+constexpr bool is_digit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+constexpr bool is_alpha(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+template <std::size_t N>
+struct parser {
+    const char* text;
+    std::size_t length;
+    std::size_t idx = 0;
+    tree<N> result = {};
+
+    constexpr char peek() {
+        while (idx < length && is_space(text[idx])) idx++;
+        return idx < length ? text[idx] : '\0';
+    }
+
+    constexpr int add(kind type, int left, int right) {
+        node& n = result.nodes[result.count];
+        n.type = type;
+        n.left = left;
+        n.right = right;
+        return result.count++;
+    }
+
+    /* Only the numbers sme_parse_number rounds exactly without strtod are accepted */
+    constexpr int number() {
+        unsigned long long mantissa = 0;
+        int digits = 0;
+        int scale = 0;
+        int fraction = 0;
+        for (; idx < length && (is_digit(text[idx]) || (text[idx] == '.' && !fraction)); idx++) {
+            if (text[idx] == '.') {
+                fraction = 1;
+                continue;
+            }
+            if (mantissa || text[idx] != '0') digits++;
+            if (digits > 19) throw "sme: number has more than 19 significant digits";
+            mantissa = mantissa * 10 + (text[idx] - '0');
+            scale += fraction;
+        }
+        if (mantissa > (1ULL << 53) || scale > 22) throw "sme: number is not exact in a double";
+        int id = add(kind::num, -1, -1);
+        result.nodes[id].value = (double) mantissa / pow10[scale];
+        return id;
+    }
+
+    constexpr bool word(std::size_t start, std::size_t size, const char* match) {
+        for (std::size_t i = 0; i < size; i++) {
+            if (match[i] == '\0' || match[i] != text[start + i]) return false;
+        }
+        return match[size] == '\0';
+    }
+
+    constexpr int slot(std::size_t start, std::size_t size) {
+        for (int i = 0; i < result.slots; i++) {
+            const name& known = result.names[i];
+            if (known.length != size) continue;
+            bool same = true;
+            for (std::size_t j = 0; j < size; j++) same = same && text[known.start + j] == text[start + j];
+            if (same) return i;
+        }
+        result.names[result.slots] = name { start, size };
+        return result.slots++;
+    }
+
+    constexpr int factor() {
+        char c = peek();
+        if (c == '(') {
+            idx++;
+            int inner = expr();
+            if (peek() != ')') throw "sme: missing right parenthesis";
+            idx++;
+            return inner;
+        }
+        if (is_digit(c)) return number();
+        if (c == '-') {
+            idx++;
+            return add(kind::neg, factor(), -1);
+        }
+        if (c == '+') {
+            idx++;
+            return add(kind::pos, factor(), -1);
+        }
+        if (is_alpha(c)) {
+            std::size_t start = idx;
+            while (idx < length && is_alpha(text[idx])) idx++;
+            if (word(start, idx - start, "floor")) return add(kind::floor, factor(), -1);
+            if (word(start, idx - start, "ceil")) return add(kind::ceil, factor(), -1);
+            std::size_t end = idx;
+            if (peek() == '(') throw "sme: functions are only supported at run time";
+            int id = add(kind::var, -1, -1);
+            result.nodes[id].slot = slot(start, end - start);
+            return id;
+        }
+        throw "sme: expected a number, name, unary operator or (";
+    }
+
+    /* Right associative, a / b * c is a / (b * c) */
+    constexpr int term() {
+        int left = factor();
+        char c = peek();
+        if (c == '*' || c == '/') {
+            idx++;
+            return add(c == '*' ? kind::mul : kind::div, left, term());
+        }
+        return left;
+    }
+
+    constexpr int expr() {
+        int left = term();
+        for (char c = peek(); c == '+' || c == '-'; c = peek()) {
+            idx++;
+            left = add(c == '+' ? kind::add : kind::sub, left, term());
+        }
+        return left;
+    }
+};
+
+template <std::size_t N>
+consteval tree<N> parse(const literal<N>& source) {
+    parser<N> state { source.text, source.size() };
+    state.result.root = state.expr();
+    if (state.peek() != '\0') throw "sme: unexpected character after the expression";
+    return state.result;
+}
+
+} // namespace detail
+
+
+/* EXPRESSION TEMPLATES */
+template <double Value>
+struct num {
+    static constexpr double eval(const double*) {
+        return Value;
+    }
+};
+
+template <int Slot>
+struct var {
+    static constexpr double eval(const double* values) {
+        return values[Slot];
+    }
+};
+
+template <class Left, class Right>
+struct add {
+    static constexpr double eval(const double* values) {
+        return Left::eval(values) + Right::eval(values);
+    }
+};
+
+template <class Left, class Right>
+struct sub {
+    static constexpr double eval(const double* values) {
+        return Left::eval(values) - Right::eval(values);
+    }
+};
+
+template <class Left, class Right>
+struct mul {
+    static constexpr double eval(const double* values) {
+        return Left::eval(values) * Right::eval(values);
+    }
+};
+
+template <class Left, class Right>
+struct div {
+    static constexpr double eval(const double* values) {
+        return Left::eval(values) / Right::eval(values);
+    }
+};
+
+template <class Operand>
+struct neg {
+    static constexpr double eval(const double* values) {
+        return -Operand::eval(values);
+    }
+};
+
+template <class Operand>
+struct pos {
+    static constexpr double eval(const double* values) {
+        return detail::abs(Operand::eval(values));
+    }
+};
+
+template <class Operand>
+struct floor {
+    static constexpr double eval(const double* values) {
+        return detail::floor(Operand::eval(values));
+    }
+};
+
+template <class Operand>
+struct ceil {
+    static constexpr double eval(const double* values) {
+        return detail::ceil(Operand::eval(values));
+    }
+};
+
+namespace detail {
+
+template <const auto& Tree, int Index>
+constexpr auto build() {
+    constexpr node n = Tree.nodes[Index];
+    if constexpr (n.type == kind::num) return num<n.value> {};
+    else if constexpr (n.type == kind::var) return var<n.slot> {};
+    else if constexpr (n.type == kind::add) return add<decltype(build<Tree, n.left>()), decltype(build<Tree, n.right>())> {};
+    else if constexpr (n.type == kind::sub) return sub<decltype(build<Tree, n.left>()), decltype(build<Tree, n.right>())> {};
+    else if constexpr (n.type == kind::mul) return mul<decltype(build<Tree, n.left>()), decltype(build<Tree, n.right>())> {};
+    else if constexpr (n.type == kind::div) return div<decltype(build<Tree, n.left>()), decltype(build<Tree, n.right>())> {};
+    else if constexpr (n.type == kind::neg) return neg<decltype(build<Tree, n.left>())> {};
+    else if constexpr (n.type == kind::pos) return pos<decltype(build<Tree, n.left>())> {};
+    else if constexpr (n.type == kind::floor) return sme::floor<decltype(build<Tree, n.left>())> {};
+    else return sme::ceil<decltype(build<Tree, n.left>())> {};
+}
+
+} // namespace detail
+
+
+/* EXPRESSION */
+template <literal Source>
+struct expr {
+    static constexpr auto tree = detail::parse(Source);
+    using type = decltype(detail::build<tree, tree.root>());
+
+    /* Number of values eval reads */
+    static constexpr int slots = tree.slots;
+
+    /* Slot of a name, -1 if the expression doesn't use it */
+    static constexpr int slot(const char* name) {
+        for (int i = 0; i < tree.slots; i++) {
+            std::size_t j = 0;
+            while (j < tree.names[i].length && name[j] == Source.text[tree.names[i].start + j]) j++;
+            if (j == tree.names[i].length && name[j] == '\0') return i;
+        }
+        return -1;
+    }
+
+    static constexpr double eval(const double* values) {
+        return type::eval(values);
+    }
+
+    /* Arguments in slot order */
+    template <class... Values>
+    constexpr double operator()(Values... args) const {
+        static_assert(sizeof...(Values) == slots, "sme: one argument per slot");
+        const double values[sizeof...(Values) + 1] = { (double) args... };
+        return type::eval(values);
+    }
+};
+
+} // namespace sme
+
+#endif
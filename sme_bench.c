@@ -0,0 +1,1126 @@
+#include <time.h>
+#include <unistd.h>
+#include <stdlib.h>
+
+#ifdef SME_BENCH_LIBRARY
+/* Linked against libsme, whose allocations don't go through this file */
+long bench_allocs = -1;
+#else
+/* Every allocation the library makes goes through these, sme.h is compiled into this file */
+long bench_allocs;
+
+void* bench_malloc(size_t size) {
+    __atomic_add_fetch(&bench_allocs, 1, __ATOMIC_RELAXED);
+    return malloc(size);
+}
+
+void* bench_calloc(size_t count, size_t size) {
+    __atomic_add_fetch(&bench_allocs, 1, __ATOMIC_RELAXED);
+    return calloc(count, size);
+}
+
+void* bench_realloc(void* pointer, size_t size) {
+    __atomic_add_fetch(&bench_allocs, 1, __ATOMIC_RELAXED);
+    return realloc(pointer, size);
+}
+
+#define malloc(size) bench_malloc(size)
+#define calloc(count, size) bench_calloc(count, size)
+#define realloc(pointer, size) bench_realloc(pointer, size)
+#define SME_IMPLEMENTATION
+#endif
+
+#include "sme.h"
+#include "sme_static.h"
+
+/* Keeps the optimizer from dropping the evaluated results */
+volatile double sink;
+
+char* bench_exprs[] = {
+        "+(2 * (4 / (2.2 + -5.4) - 22) * 2 + ceil(floor(33.4 + 2.4) * 2.4))",
+        "a + b * x / y",
+        "floor(a * b + x) - ceil(a * b + y) * (a - b) / (x + y) + -a * -b"
+};
+
+/* Batches of calls, every kernel set against one row at a time */
+char* bench_calls[] = {
+        "exp(a) - log(b)",
+        "sin(a) * cos(b) + tan(a / b)",
+        "pow(a, b / 8)",
+        "sqrt(a * a + b * b) + round(max(a, b) / min(a, b))"
+};
+
+char* kernel_names[] = { "scalar", "sse2", "avx2", "avx512" };
+
+double bench_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* OUTPUT */
+enum BenchFormat {
+    BenchText,
+    BenchCSV,
+    BenchJSON
+};
+
+enum BenchFormat bench_format = BenchText;
+int bench_records = 0;
+
+/* Percentiles and allocations are negative and tokens 0 where a benchmark doesn't measure them */
+typedef struct BenchResult {
+    const char* name;
+    const char* workload;
+    double ns;
+    double p50;
+    double p90;
+    double p99;
+    double allocs;
+    double tokens;
+} BenchResult;
+
+/* Quotes a field, CSV doubles quotes and JSON escapes them and backslashes */
+void bench_quoted(const char* text) {
+    putchar('"');
+    for (; *text; text++) {
+        if (*text == '"') fputs(bench_format == BenchCSV ? "\"\"" : "\\\"", stdout);
+        else if (*text == '\\' && bench_format == BenchJSON) fputs("\\\\", stdout);
+        else putchar(*text);
+    }
+    putchar('"');
+}
+
+void bench_number(double value, const char* missing) {
+    if (value < 0) fputs(missing, stdout);
+    else printf("%.3f", value);
+}
+
+void bench_emit(const BenchResult* result) {
+    if (bench_format == BenchText) {
+        printf("%-12s %10.2f ns/op  ", result->name, result->ns);
+        if (result->p50 >= 0) printf("p50 %.2f  p90 %.2f  p99 %.2f  ", result->p50, result->p90, result->p99);
+        if (result->allocs >= 0) printf("%.2f allocs  ", result->allocs);
+        if (result->tokens > 0) printf("%.1f Mtok/s  ", result->tokens / 1e6);
+        printf("%s\n", result->workload);
+    } else if (bench_format == BenchCSV) {
+        if (bench_records == 0) printf("name,workload,ns_per_op,p50,p90,p99,allocs_per_op,tokens_per_s\n");
+        bench_quoted(result->name);
+        putchar(',');
+        bench_quoted(result->workload);
+        printf(",%.3f,", result->ns);
+        bench_number(result->p50, "");
+        putchar(',');
+        bench_number(result->p90, "");
+        putchar(',');
+        bench_number(result->p99, "");
+        putchar(',');
+        bench_number(result->allocs, "");
+        putchar(',');
+        bench_number(result->tokens > 0 ? result->tokens : -1, "");
+        putchar('\n');
+    } else {
+        printf("%s\n  {\"name\": ", bench_records ? "," : "[");
+        bench_quoted(result->name);
+        printf(", \"workload\": ");
+        bench_quoted(result->workload);
+        printf(", \"ns_per_op\": %.3f, \"p50\": ", result->ns);
+        bench_number(result->p50, "null");
+        printf(", \"p90\": ");
+        bench_number(result->p90, "null");
+        printf(", \"p99\": ");
+        bench_number(result->p99, "null");
+        printf(", \"allocs_per_op\": ");
+        bench_number(result->allocs, "null");
+        printf(", \"tokens_per_s\": ");
+        bench_number(result->tokens > 0 ? result->tokens : -1, "null");
+        putchar('}');
+    }
+    bench_records++;
+}
+
+void bench_finish() {
+    if (bench_format == BenchJSON) printf("%s]\n", bench_records ? "\n" : "[");
+}
+
+void bench_report(const char* name, const char* expr, double seconds, long iterations) {
+    BenchResult result = { name, expr, seconds * 1e9 / iterations, -1, -1, -1, -1, 0 };
+    bench_emit(&result);
+}
+
+#define BENCH_SAMPLES 100
+
+int bench_compare_doubles(const void* a, const void* b) {
+    double x = *(const double*) a;
+    double y = *(const double*) b;
+    return (x > y) - (x < y);
+}
+
+/* Runs function calls times in BENCH_SAMPLES rounds after one warm up call. Every call does ops
+ * operations over tokens tokens, the percentiles are over the mean time per operation of each round. */
+void bench_measure(const char* name, const char* workload, void (*function)(void*), void* arg,
+                   long calls, int ops, int tokens) {
+    double samples[BENCH_SAMPLES];
+    long per_round = calls / BENCH_SAMPLES > 0 ? calls / BENCH_SAMPLES : 1;
+    double total = 0;
+    function(arg);
+    long allocs = bench_allocs;
+    for (int s = 0; s < BENCH_SAMPLES; s++) {
+        double start = bench_now();
+        for (long i = 0; i < per_round; i++) function(arg);
+        samples[s] = (bench_now() - start) * 1e9 / ((double) per_round * ops);
+        total += samples[s];
+    }
+    allocs = bench_allocs - allocs;
+    qsort(samples, BENCH_SAMPLES, sizeof(double), bench_compare_doubles);
+
+    BenchResult result;
+    result.name = name;
+    result.workload = workload;
+    result.ns = total / BENCH_SAMPLES;
+    /* Nearest rank */
+    result.p50 = samples[(BENCH_SAMPLES * 50 + 99) / 100 - 1];
+    result.p90 = samples[(BENCH_SAMPLES * 90 + 99) / 100 - 1];
+    result.p99 = samples[(BENCH_SAMPLES * 99 + 99) / 100 - 1];
+    result.allocs = bench_allocs < 0 ? -1 : (double) allocs / ((double) per_round * BENCH_SAMPLES * ops);
+    result.tokens = tokens ? tokens * 1e9 / (result.ns * ops) : 0;
+    bench_emit(&result);
+}
+
+/* Tree walker against the bytecode VM on the same compiled expression */
+void bench_eval(char* buffer, long iterations) {
+    SMEList* vars = new_SMEList();
+    SMEVar* var_a = new_SMEVar("a", 3.4);
+    SMEVar* var_b = new_SMEVar("b", 5.6);
+    SMEVar* var_x = new_SMEVar("x", -9.23);
+    SMEVar* var_y = new_SMEVar("y", 2);
+    append_SMEItem(vars, var_a);
+    append_SMEItem(vars, var_b);
+    append_SMEItem(vars, var_x);
+    append_SMEItem(vars, var_y);
+    SMEExpr* expr = sme_compile(buffer, vars);
+    int slot = sme_slot(expr, "a");
+    double start;
+    double acc = 0;
+
+    start = bench_now();
+    for (long i = 0; i < iterations; i++) {
+        if (slot >= 0) sme_bind(expr, slot, (double) i);
+        acc += sme_eval_slots(expr->root, expr->values);
+    }
+    bench_report("tree", buffer, bench_now() - start, iterations);
+
+    start = bench_now();
+    for (long i = 0; i < iterations; i++) {
+        if (slot >= 0) sme_bind(expr, slot, (double) i);
+        acc += sme_evaluate(expr);
+    }
+    bench_report("vm", buffer, bench_now() - start, iterations);
+
+    sink = acc;
+    free_SMEExpr(expr);
+    free_SMEVar(var_a);
+    free_SMEVar(var_b);
+    free_SMEVar(var_x);
+    free_SMEVar(var_y);
+    free_SMEList(vars);
+}
+
+/* The bytecode VM before and after constant folding and simplification */
+void bench_optimize(char* buffer, long iterations) {
+    SMEExpr* expr = sme_compile(buffer, NULL);
+    SMEOptimizeStats stats;
+    double start;
+    double acc = 0;
+    for (int i = 0; i < expr->slots->count; i++) sme_bind(expr, i, i + 1.5);
+
+    start = bench_now();
+    for (long i = 0; i < iterations; i++) acc += sme_evaluate(expr);
+    bench_report("unoptimized", buffer, bench_now() - start, iterations);
+
+    sme_optimize_expr(expr, &stats);
+    start = bench_now();
+    for (long i = 0; i < iterations; i++) acc += sme_evaluate(expr);
+    bench_report("optimized", buffer, bench_now() - start, iterations);
+    if (bench_format == BenchText)
+        printf("%-12s %10d -> %d, %d folded, %d simplified\n", "nodes", stats.nodes_before, stats.nodes_after,
+               stats.folded, stats.simplified);
+
+    sink = acc;
+    free_SMEExpr(expr);
+}
+
+/* Related formulas compiled one by one against one shared DAG, per evaluation of the whole set */
+void bench_dag(long iterations) {
+    char* exprs[] = {
+            "floor(a * b + c) * x - ceil(a * b + c) / y",
+            "floor(a * b + c) + floor(a * b + c) * floor(a * b + c)",
+            "(x - y) * floor(a * b + c) - (x - y) / ceil(a * b + c)",
+            "ceil(a * b + c) * (x + y) + floor(a * b + c) * (x - y)"
+    };
+    int count = (int) (sizeof(exprs) / sizeof(exprs[0]));
+    SMEExpr* compiled[4];
+    SMEDag* dag = new_SMEDag();
+    double out[4];
+    char label[32];
+    double start;
+    double acc = 0;
+    int nodes = 0;
+    for (int e = 0; e < count; e++) {
+        compiled[e] = sme_compile(exprs[e], NULL);
+        for (int i = 0; i < compiled[e]->slots->count; i++) sme_bind(compiled[e], i, i + 1.5);
+        sme_dag_compile(dag, exprs[e], strlen(exprs[e]));
+        nodes += compiled[e]->code->count - 1;
+    }
+    for (int i = 0; i < dag->slots->count; i++) dag->slots->values[i] = i + 1.5;
+
+    start = bench_now();
+    for (long i = 0; i < iterations; i++) {
+        for (int e = 0; e < count; e++) acc += sme_evaluate(compiled[e]);
+    }
+    sprintf(label, "trees/%d", nodes);
+    bench_report(label, "4 formulas sharing floor(a * b + c)", bench_now() - start, iterations);
+
+    start = bench_now();
+    for (long i = 0; i < iterations; i++) {
+        sme_dag_evaluate(dag, out);
+        acc += out[0];
+    }
+    sprintf(label, "dag/%d", dag->count);
+    bench_report(label, "4 formulas sharing floor(a * b + c)", bench_now() - start, iterations);
+
+    sink = acc;
+    for (int e = 0; e < count; e++) free_SMEExpr(compiled[e]);
+    free_SMEDag(dag);
+}
+
+typedef struct BenchWorker {
+    SMEExpr* expr;
+    long iterations;
+    double acc;
+} BenchWorker;
+
+void* bench_thread_worker(void* arg) {
+    BenchWorker* worker = arg;
+    SMEContext* context = new_SMEContext(worker->expr);
+    int slot = sme_slot(worker->expr, "a");
+    double acc = 0;
+    for (long i = 0; i < worker->iterations; i++) {
+        if (slot >= 0) sme_context_bind(context, slot, (double) i);
+        acc += sme_evaluate_context(worker->expr, context);
+    }
+    worker->acc = acc;
+    free_SMEContext(context);
+    return NULL;
+}
+
+/* One shared compiled expression evaluated by 1 up to every core, the same total work split evenly */
+void bench_threads(char* buffer, long iterations) {
+    int cores = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    SMEExpr* expr = sme_compile(buffer, NULL);
+    pthread_t* threads = malloc(sizeof(pthread_t) * cores);
+    BenchWorker* workers = malloc(sizeof(BenchWorker) * cores);
+    char label[32];
+    char note[160];
+    double single = 0;
+    for (int i = 0; i < expr->slots->count; i++) sme_bind(expr, i, i + 1.5);
+
+    for (int count = 1; count <= cores; count = count * 2 > cores && count < cores ? cores : count * 2) {
+        double start = bench_now();
+        for (int t = 0; t < count; t++) {
+            workers[t].expr = expr;
+            workers[t].iterations = iterations / count;
+            pthread_create(&threads[t], NULL, bench_thread_worker, &workers[t]);
+        }
+        for (int t = 0; t < count; t++) {
+            pthread_join(threads[t], NULL);
+            sink = workers[t].acc;
+        }
+        double seconds = bench_now() - start;
+        if (count == 1) single = seconds;
+        sprintf(label, "threads/%d", count);
+        sprintf(note, "%.2fx  %s", single / seconds, buffer);
+        bench_report(label, note, seconds, iterations);
+    }
+
+    free(threads);
+    free(workers);
+    free_SMEExpr(expr);
+}
+
+/* Native code against the bytecode VM it falls back on */
+void bench_jit(char* buffer, long iterations) {
+    SMEExpr* expr = sme_compile(buffer, NULL);
+    SMEJit* jit = new_SMEJit(expr->root);
+    int slot = sme_slot(expr, "a");
+    double start;
+    double acc = 0;
+    for (int i = 0; i < expr->slots->count; i++) sme_bind(expr, i, i + 1.5);
+
+    start = bench_now();
+    for (long i = 0; i < iterations; i++) {
+        if (slot >= 0) sme_bind(expr, slot, (double) i);
+        acc += sme_run(jit->code, expr->values, jit->stack);
+    }
+    bench_report("vm", buffer, bench_now() - start, iterations);
+
+    start = bench_now();
+    for (long i = 0; i < iterations; i++) {
+        if (slot >= 0) sme_bind(expr, slot, (double) i);
+        acc += sme_jit_evaluate(jit, expr->values);
+    }
+    bench_report(jit->function ? "jit" : "jit/vm", buffer, bench_now() - start, iterations);
+
+    sink = acc;
+    free_SMEJit(jit);
+    free_SMEExpr(expr);
+}
+
+/* Formulas parsed by the C++ compiler against the same source compiled at runtime */
+void bench_static(char* buffer, long iterations) {
+    const SMEStaticFormula* formula = NULL;
+    for (int i = 0; i < sme_static_count; i++) {
+        if (!strcmp(sme_static_formulas[i].source, buffer)) formula = &sme_static_formulas[i];
+    }
+    if (formula == NULL) return;
+
+    SMEExpr* expr = sme_compile(buffer, NULL);
+    int slot = sme_slot(expr, "a");
+    double start;
+    double acc = 0;
+    for (int i = 0; i < expr->slots->count; i++) sme_bind(expr, i, i + 1.5);
+
+    start = bench_now();
+    for (long i = 0; i < iterations; i++) {
+        if (slot >= 0) sme_bind(expr, slot, (double) i);
+        acc += sme_evaluate(expr);
+    }
+    bench_report("runtime", buffer, bench_now() - start, iterations);
+
+    start = bench_now();
+    for (long i = 0; i < iterations; i++) {
+        if (slot >= 0) sme_bind(expr, slot, (double) i);
+        acc += formula->function(expr->values);
+    }
+    bench_report("static", buffer, bench_now() - start, iterations);
+
+    sink = acc;
+    free_SMEExpr(expr);
+}
+
+/* Startup from source against loading a saved image, from memory and through mmap */
+void bench_image(char* buffer, long iterations) {
+    SMEExpr* expr = sme_compile(buffer, NULL);
+    size_t size = sme_image_write(expr, NULL);
+    double* bytes = malloc(size + 8);
+    double values[16] = { 0 };
+    char path[] = "/tmp/sme_benchXXXXXX";
+    double start;
+    double acc = 0;
+    sme_image_write(expr, bytes);
+    close(mkstemp(path));
+    sme_image_save(expr, path);
+
+    start = bench_now();
+    for (long i = 0; i < iterations; i++) {
+        SMEExpr* compiled = sme_compile(buffer, NULL);
+        acc += compiled->code->count;
+        free_SMEExpr(compiled);
+    }
+    bench_report("compile", buffer, bench_now() - start, iterations);
+
+    start = bench_now();
+    for (long i = 0; i < iterations; i++) {
+        SMEImage* image = sme_image_open(bytes, size);
+        acc += image->code.count;
+        free_SMEImage(image);
+    }
+    bench_report("image/open", buffer, bench_now() - start, iterations);
+
+    start = bench_now();
+    for (long i = 0; i < iterations / 10; i++) {
+        SMEImage* image = sme_image_map(path);
+        acc += sme_image_evaluate(image, values);
+        free_SMEImage(image);
+    }
+    bench_report("image/map", buffer, bench_now() - start, iterations / 10);
+
+    sink = acc;
+    remove(path);
+    free(bytes);
+    free_SMEExpr(expr);
+}
+
+/* Full tokenize/parse/eval cycles on the heap against an arena */
+void bench_calc(char* buffer, long iterations) {
+    SMEArena* arena = new_SMEArena(0);
+    double start;
+    double acc = 0;
+
+    start = bench_now();
+    for (long i = 0; i < iterations; i++) {
+        acc += sme_calc(buffer, NULL);
+    }
+    bench_report("calc", buffer, bench_now() - start, iterations);
+
+    start = bench_now();
+    for (long i = 0; i < iterations; i++) {
+        acc += sme_calc_arena(buffer, NULL, arena);
+    }
+    bench_report("arena", buffer, bench_now() - start, iterations);
+
+    sink = acc;
+    free_SMEArena(arena);
+}
+
+/* Recompiling on every call against the cache, first with room for every source then for half of them */
+void bench_cache(int distinct, long iterations) {
+    char** sources = malloc(sizeof(char*) * distinct);
+    SMEList* vars = new_SMEList();
+    SMEVar* var_a = new_SMEVar("a", 1.5);
+    SMEVar* var_b = new_SMEVar("b", 2);
+    SMEArena* arena = new_SMEArena(0);
+    SMECacheStats stats;
+    size_t budget = (size_t) 1 << 30;
+    char note[64];
+    double start;
+    double acc = 0;
+    append_SMEItem(vars, var_a);
+    append_SMEItem(vars, var_b);
+    for (int i = 0; i < distinct; i++) {
+        sources[i] = malloc(64);
+        sprintf(sources[i], "floor(a * %d.25) / b - (a - %d) * b", i, i);
+    }
+
+    start = bench_now();
+    for (long i = 0; i < iterations; i++) {
+        var_a->value = (double) i;
+        acc += sme_calc_arena(sources[(i * 7919) % distinct], vars, arena);
+    }
+    sprintf(note, "%d sources", distinct);
+    bench_report("calc", note, bench_now() - start, iterations);
+
+    for (int round = 0; round < 2; round++) {
+        SMECache* cache = new_SMECache(budget);
+        start = bench_now();
+        for (long i = 0; i < iterations; i++) {
+            var_a->value = (double) i;
+            /* Scattered so that half the budget gives about half the hits */
+            acc += sme_cache_calc(cache, sources[(i * 7919 + i / distinct) % distinct], vars);
+        }
+        double seconds = bench_now() - start;
+        sme_cache_stats(cache, &stats);
+        sprintf(note, "%d sources, %.0f%% hits, %ld evictions", distinct,
+                100.0 * stats.hits / (stats.hits + stats.misses), stats.evictions);
+        bench_report("cache", note, seconds, iterations);
+        budget = stats.bytes / 2;
+        free_SMECache(cache);
+    }
+
+    sink = acc;
+    for (int i = 0; i < distinct; i++) free(sources[i]);
+    free(sources);
+    free_SMEArena(arena);
+    free_SMEVar(var_a);
+    free_SMEVar(var_b);
+    free_SMEList(vars);
+}
+
+/* The tokenizer against the single pass lexer on an expression of terms terms */
+void bench_lex(int terms, long iterations) {
+    char* buffer = malloc(terms * 32 + 1);
+    SMEList* vars = new_SMEList();
+    SMEVarTable* table = new_SMEVarTable();
+    SMEToken* tokens = malloc(sizeof(SMEToken) * terms * 8);
+    char label[32];
+    size_t length = 0;
+    double start;
+    double acc = 0;
+    for (int i = 0; i < terms; i++) {
+        length += sprintf(buffer + length, "%sfloor(a * %d.25) / b", i ? " - " : "", i);
+    }
+    append_SMEItem(vars, new_SMEVar("a", 1));
+    append_SMEItem(vars, new_SMEVar("b", 2));
+
+    start = bench_now();
+    for (long i = 0; i < iterations; i++) {
+        SMETokenizer* tokenizer = sme_tokenize(buffer, vars);
+        acc += tokenizer->list->count;
+        tokenizer->variables = NULL;
+        free_SMETokenizer(tokenizer);
+    }
+    sprintf(label, "tokenize/%d", terms);
+    bench_report(label, "floor(a * 0.25) / b - ...", bench_now() - start, iterations);
+
+    start = bench_now();
+    for (long i = 0; i < iterations; i++) {
+        acc += sme_lex(buffer, length, table, tokens, terms * 8);
+    }
+    sprintf(label, "lex/%d", terms);
+    bench_report(label, "floor(a * 0.25) / b - ...", bench_now() - start, iterations);
+
+    sink = acc;
+    free_SMEVar(vars->items[0]);
+    free_SMEVar(vars->items[1]);
+    free_SMEList(vars);
+    free_SMEVarTable(table);
+    free(tokens);
+    free(buffer);
+}
+
+/* A multi-megabyte expression pushed through the streaming evaluator in chunks, per byte */
+void bench_stream(int terms, int chunk) {
+    char* buffer = malloc(terms * 32 + 1);
+    SMEVarTable* table = new_SMEVarTable();
+    char label[32];
+    size_t length = 0;
+    double start;
+    for (int i = 0; i < terms; i++) {
+        length += sprintf(buffer + length, "%sfloor(a * %d.25) / b", i ? " - " : "", i);
+    }
+    sme_var_set(table, "a", 1);
+    sme_var_set(table, "b", 2);
+
+    start = bench_now();
+    SMEStream* stream = new_SMEStream(table);
+    for (size_t i = 0; i < length; i += chunk) {
+        sme_stream_feed(stream, buffer + i, length - i < (size_t) chunk ? length - i : (size_t) chunk);
+    }
+    sme_stream_end(stream);
+    sink = stream->result;
+    sprintf(label, "stream/%d", chunk);
+    bench_report(label, "bytes of floor(a * 0.25) / b - ...", bench_now() - start, (long) length);
+    free_SMEStream(stream);
+
+    /* Lexing alone needs the whole input and a token per byte in the worst case */
+    SMEToken* tokens = malloc(sizeof(SMEToken) * length);
+    start = bench_now();
+    sink = sme_lex(buffer, length, table, tokens, (int) length);
+    bench_report("lex", "bytes of floor(a * 0.25) / b - ...", bench_now() - start, (long) length);
+    free(tokens);
+
+    free_SMEVarTable(table);
+    free(buffer);
+}
+
+/* Recursive descent against the explicit-stack parser and evaluator on depth nested parentheses */
+void bench_nesting(int depth, long iterations, int recursive) {
+    char* buffer = malloc(depth * 6 + 2);
+    SMEVarTable* table = new_SMEVarTable();
+    SMEArena* arena = new_SMEArena(0);
+    SMEToken* tokens = malloc(sizeof(SMEToken) * (depth * 4 + 1));
+    char label[32];
+    size_t length = 0;
+    double start;
+    double acc = 0;
+    for (int i = 0; i < depth; i++) length += sprintf(buffer + length, "(x-");
+    buffer[length++] = '1';
+    for (int i = 0; i < depth; i++) buffer[length++] = ')';
+    buffer[length] = '\0';
+    sme_var_set(table, "x", 2);
+    int count = sme_lex(buffer, length, table, tokens, depth * 4 + 1);
+
+    /* The recursive parser runs out of native stack long before a million levels */
+    if (recursive) {
+        start = bench_now();
+        for (long i = 0; i < iterations; i++) {
+            acc += sme_eval_slots(sme_parse_tokens(tokens, count, arena), table->values);
+            sme_arena_reset(arena);
+        }
+        sprintf(label, "recursive/%d", depth);
+        bench_report(label, "(x-(x-(...(x-1)...)))", bench_now() - start, iterations);
+    }
+
+    start = bench_now();
+    for (long i = 0; i < iterations; i++) {
+        acc += sme_eval_iterative(sme_parse_iterative(tokens, count, arena), table->values);
+        sme_arena_reset(arena);
+    }
+    sprintf(label, "iterative/%d", depth);
+    bench_report(label, "(x-(x-(...(x-1)...)))", bench_now() - start, iterations);
+
+    sink = acc;
+    free_SMEArena(arena);
+    free_SMEVarTable(table);
+    free(tokens);
+    free(buffer);
+}
+
+/* Writes a letters-only variable name for i */
+void bench_var_name(char* name, int i) {
+    int j = 0;
+    do {
+        name[j++] = (char) ('a' + i % 26);
+        i /= 26;
+    } while (i);
+    name[j] = '\0';
+}
+
+/* Variable resolution through a list scan against the hashed table, for count variables */
+void bench_lookup(int count, long iterations) {
+    SMEList* list = new_SMEList();
+    SMEVarTable* table = new_SMEVarTable();
+    char names[8][16];
+    char buffer[256];
+    char label[32];
+    double start;
+    double acc = 0;
+    for (int i = 0; i < count; i++) {
+        char name[16];
+        bench_var_name(name, i);
+        append_SMEItem(list, new_SMEVar(name, i));
+        sme_var_set(table, name, i);
+    }
+    /* Names spread over the whole table, the last one is the worst case for the list */
+    buffer[0] = '\0';
+    for (int i = 0; i < 8; i++) {
+        bench_var_name(names[i], (int) ((long) count * (i + 1) / 8 - 1));
+        strcat(buffer, i ? " + " : "");
+        strcat(buffer, names[i]);
+    }
+
+    start = bench_now();
+    for (long i = 0; i < iterations; i++) {
+        SMEVar* var = list->items[0];
+        for (int j = 0; j < list->count; j++) {
+            var = list->items[j];
+            if (!strcmp(names[i & 7], var->name)) break;
+        }
+        acc += var->value;
+    }
+    sprintf(label, "list/%d", count);
+    bench_report(label, "lookup", bench_now() - start, iterations);
+
+    start = bench_now();
+    for (long i = 0; i < iterations; i++) {
+        acc += table->values[sme_var_lookup(table, names[i & 7])];
+    }
+    sprintf(label, "table/%d", count);
+    bench_report(label, "lookup", bench_now() - start, iterations);
+
+    start = bench_now();
+    for (long i = 0; i < iterations / 8; i++) {
+        SMETokenizer* tokenizer = sme_tokenize(buffer, list);
+        acc += tokenizer->list->count;
+        tokenizer->variables = NULL;
+        free_SMETokenizer(tokenizer);
+    }
+    sprintf(label, "list/%d", count);
+    bench_report(label, buffer, bench_now() - start, iterations / 8);
+
+    start = bench_now();
+    for (long i = 0; i < iterations / 8; i++) {
+        SMETokenizer* tokenizer = sme_tokenize_table(buffer, table);
+        acc += tokenizer->list->count;
+        free_SMETokenizer(tokenizer);
+    }
+    sprintf(label, "table/%d", count);
+    bench_report(label, buffer, bench_now() - start, iterations / 8);
+
+    sink = acc;
+    for (int i = 0; i < list->count; i++) free_SMEVar(list->items[i]);
+    free_SMEList(list);
+    free_SMEVarTable(table);
+}
+
+/* A tick of 24 formulas over 50 variables, each through sme_calc against one program run */
+void bench_program(long iterations) {
+    SMEList* vars = new_SMEList();
+    SMEProgram* program = new_SMEProgram();
+    char sources[24][64];
+    char name[16];
+    double out[24];
+    double start;
+    double acc = 0;
+    for (int i = 0; i < 50; i++) {
+        bench_var_name(name, i + 26);
+        append_SMEItem(vars, new_SMEVar(name, i * 0.5));
+        sme_var_set(program->slots, name, i * 0.5);
+    }
+    for (int i = 0; i < 24; i++) {
+        char a[16], b[16], c[16];
+        bench_var_name(a, 26 + i * 2);
+        bench_var_name(b, 27 + i * 2);
+        bench_var_name(c, 26 + (i * 7) % 50);
+        sprintf(sources[i], "floor(%s * %s + %s) / (%s - %s + 1)", a, b, c, a, c);
+        bench_var_name(name, i);
+        sme_program_define(program, name, sources[i]);
+    }
+    sme_program_build(program);
+
+    start = bench_now();
+    for (long i = 0; i < iterations; i++) {
+        /* sme_calc without handing over the variable list */
+        for (int j = 0; j < 24; j++) {
+            SMETokenizer* tokenizer = sme_tokenize(sources[j], vars);
+            SMENode* root = sme_parse(tokenizer);
+            acc += sme_eval(root);
+            free_SMENode(root);
+            tokenizer->variables = NULL;
+            free_SMETokenizer(tokenizer);
+        }
+    }
+    bench_report("calc/24", "formulas per tick", bench_now() - start, iterations);
+
+    start = bench_now();
+    for (long i = 0; i < iterations; i++) {
+        acc += sme_program_evaluate(program, out);
+    }
+    bench_report("program/24", "formulas per tick", bench_now() - start, iterations);
+
+    sink = acc;
+    for (int i = 0; i < vars->count; i++) free_SMEVar(vars->items[i]);
+    free_SMEList(vars);
+    free_SMEProgram(program);
+}
+
+/* 24 formulas over 50 variables with two variables changing per tick, all nodes against the dirty ones */
+void bench_incremental(long iterations) {
+    SMEDag* dag = new_SMEDag();
+    char source[128];
+    char label[32];
+    double out[24];
+    double start;
+    double acc = 0;
+    long recomputed = 0;
+    for (int i = 0; i < 24; i++) {
+        char a[16], b[16], c[16];
+        bench_var_name(a, 26 + i * 2);
+        bench_var_name(b, 27 + i * 2);
+        bench_var_name(c, 26 + (i * 7) % 50);
+        sprintf(source, "floor(%s * %s + %s) / (%s - %s + 1)", a, b, c, a, c);
+        sme_dag_compile(dag, source, strlen(source));
+    }
+    for (int i = 0; i < dag->slots->count; i++) dag->slots->values[i] = i * 0.5;
+    sme_dag_update(dag, out);
+
+    start = bench_now();
+    for (long i = 0; i < iterations; i++) {
+        dag->slots->values[i % 50] = (double) i;
+        dag->slots->values[(i * 7 + 3) % 50] = (double) -i;
+        sme_dag_evaluate(dag, out);
+        acc += out[0];
+    }
+    sprintf(label, "full/%d", dag->count);
+    bench_report(label, "2 of 50 variables changed", bench_now() - start, iterations);
+
+    start = bench_now();
+    for (long i = 0; i < iterations; i++) {
+        sme_dag_set(dag, (int) (i % 50), (double) i);
+        sme_dag_set(dag, (int) ((i * 7 + 3) % 50), (double) -i);
+        sme_dag_update(dag, out);
+        recomputed += dag->recomputed;
+        acc += out[0];
+    }
+    sprintf(label, "dirty/%.1f", (double) recomputed / iterations);
+    bench_report(label, "2 of 50 variables changed", bench_now() - start, iterations);
+
+    sink = acc;
+    free_SMEDag(dag);
+}
+
+/* Per-row sme_evaluate against block-at-a-time batch evaluation */
+void bench_batch(char* buffer, int rows) {
+    SMEList* vars = new_SMEList();
+    SMEExpr* expr = sme_compile(buffer, vars);
+    int count = expr->slots->count;
+    double** columns = malloc(sizeof(double*) * count);
+    double* out = malloc(sizeof(double) * rows);
+    double start;
+    for (int j = 0; j < count; j++) {
+        columns[j] = malloc(sizeof(double) * rows);
+        for (int i = 0; i < rows; i++) columns[j][i] = (i % 97) * 0.25 + j + 1;
+    }
+
+    start = bench_now();
+    for (int i = 0; i < rows; i++) {
+        for (int j = 0; j < count; j++) sme_bind(expr, j, columns[j][i]);
+        out[i] = sme_evaluate(expr);
+    }
+    bench_report("rows", buffer, bench_now() - start, rows);
+    sink = out[rows / 2];
+
+    /* Once per kernel set the CPU supports */
+    for (int k = 0; k < 4; k++) {
+        if (sme_select_kernels(kernel_names[k])) continue;
+        start = bench_now();
+        sme_evaluate_batch(expr, (const double* const*) columns, out, rows);
+        bench_report(kernel_names[k], buffer, bench_now() - start, rows);
+        sink = out[rows / 2];
+    }
+    sme_select_kernels(sme_detect_kernels()->name);
+
+    for (int j = 0; j < count; j++) free(columns[j]);
+    free(columns);
+    free(out);
+    free_SMEExpr(expr);
+    free_SMEList(vars);
+}
+
+/* Parallel batch evaluation on 1 up to every core, per row */
+void bench_parallel(char* buffer, int rows) {
+    int cores = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    SMEExpr* expr = sme_compile(buffer, NULL);
+    int count = expr->slots->count;
+    double** columns = malloc(sizeof(double*) * count);
+    void* out = NULL;
+    char label[32];
+    char note[160];
+    double single = 0;
+    double start;
+    posix_memalign(&out, SME_CACHE_LINE, sizeof(double) * rows);
+    for (int j = 0; j < count; j++) {
+        columns[j] = malloc(sizeof(double) * rows);
+        for (int i = 0; i < rows; i++) columns[j][i] = (i % 97) * 0.25 + j + 1;
+    }
+
+    start = bench_now();
+    sme_evaluate_batch(expr, (const double* const*) columns, out, rows);
+    bench_report("batch", buffer, bench_now() - start, rows);
+
+    for (int threads = 1; threads <= cores; threads = threads * 2 > cores && threads < cores ? cores : threads * 2) {
+        SMEPool* pool = new_SMEPool(threads);
+        /* Once to warm up the workers' scratch memory */
+        sme_evaluate_batch_parallel(pool, expr, (const double* const*) columns, out, rows);
+        start = bench_now();
+        sme_evaluate_batch_parallel(pool, expr, (const double* const*) columns, out, rows);
+        double seconds = bench_now() - start;
+        if (threads == 1) single = seconds;
+        sprintf(label, "parallel/%d", threads);
+        sprintf(note, "%.2fx  %s", single / seconds, buffer);
+        bench_report(label, note, seconds, rows);
+        sink = ((double*) out)[rows / 2];
+        free_SMEPool(pool);
+    }
+
+    for (int j = 0; j < count; j++) free(columns[j]);
+    free(columns);
+    free(out);
+    free_SMEExpr(expr);
+}
+
+/* A serial sme_compile loop against bulk compilation on 1 up to every core, per expression */
+void bench_bulk(int count) {
+    int cores = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    char** sources = malloc(sizeof(char*) * count);
+    SMECompileResult* results = malloc(sizeof(SMECompileResult) * count);
+    char label[32];
+    char note[64];
+    double single = 0;
+    double start;
+    for (int i = 0; i < count; i++) {
+        sources[i] = malloc(96);
+        sprintf(sources[i], "floor(a%c * %d.5 + b) / (c - %d) + ceil(a%c * b) * -c", 'a' + i % 26, i, i % 7, 'a' + i % 5);
+    }
+
+    start = bench_now();
+    for (int i = 0; i < count; i++) results[i].expr = sme_compile(sources[i], NULL);
+    single = bench_now() - start;
+    bench_report("compile", "config formulas", single, count);
+    for (int i = 0; i < count; i++) free_SMEExpr(results[i].expr);
+
+    for (int threads = 1; threads <= cores; threads = threads * 2 > cores && threads < cores ? cores : threads * 2) {
+        SMEPool* pool = new_SMEPool(threads);
+        start = bench_now();
+        sme_compile_bulk(pool, (const char* const*) sources, count, results);
+        double seconds = bench_now() - start;
+        sprintf(label, "bulk/%d", threads);
+        sprintf(note, "%.2fx  config formulas", single / seconds);
+        bench_report(label, note, seconds, count);
+        for (int i = 0; i < count; i++) free_SMEExpr(results[i].expr);
+        free_SMEPool(pool);
+    }
+
+    for (int i = 0; i < count; i++) free(sources[i]);
+    free(sources);
+    free(results);
+}
+
+/* SUITE */
+/* One fixed input per workload, with what each phase needs prepared ahead of time */
+typedef struct BenchWorkload {
+    const char* name;
+    char* source;
+    SMEList* vars;
+    SMETokenizer* tokenizer;
+    SMENode* root;
+    SMEExpr* expr;
+    int tokens;
+} BenchWorkload;
+
+typedef struct BenchBatch {
+    SMEExpr* expr;
+    double** columns;
+    double* out;
+    int rows;
+} BenchBatch;
+
+void bench_suite_tokenize(void* arg) {
+    BenchWorkload* workload = arg;
+    SMETokenizer* tokenizer = sme_tokenize(workload->source, workload->vars);
+    /* The variables belong to the workload */
+    tokenizer->variables = NULL;
+    free_SMETokenizer(tokenizer);
+}
+
+void bench_suite_parse(void* arg) {
+    BenchWorkload* workload = arg;
+    workload->tokenizer->tidx = 0;
+    workload->tokenizer->current = NULL;
+    free_SMENode(sme_parse(workload->tokenizer));
+}
+
+void bench_suite_eval(void* arg) {
+    BenchWorkload* workload = arg;
+    sink = sme_eval(workload->root);
+}
+
+void bench_suite_compile(void* arg) {
+    BenchWorkload* workload = arg;
+    free_SMEExpr(sme_compile(workload->source, workload->vars));
+}
+
+void bench_suite_vm(void* arg) {
+    BenchWorkload* workload = arg;
+    sink = sme_evaluate(workload->expr);
+}
+
+void bench_suite_batch(void* arg) {
+    BenchBatch* batch = arg;
+    sme_evaluate_batch(batch->expr, (const double* const*) batch->columns, batch->out, batch->rows);
+}
+
+/* Every phase on short and long expressions, deep nesting and many variables, then batches. The
+ * inputs are generated the same way every run, so results compare between versions. */
+void bench_suite(long iterations) {
+    BenchWorkload workloads[4];
+    size_t length = 0;
+    char name[3] = { 0 };
+    for (int w = 0; w < 4; w++) {
+        workloads[w].source = malloc(8192);
+        workloads[w].vars = new_SMEList();
+    }
+
+    workloads[0].name = "short";
+    strcpy(workloads[0].source, "a + b * x / y");
+
+    workloads[1].name = "long";
+    for (int i = 0; i < 250; i++) {
+        length += sprintf(workloads[1].source + length, "%sfloor(a * %d.25) / b", i ? " - " : "", i);
+    }
+
+    workloads[2].name = "nested";
+    length = 0;
+    for (int i = 0; i < 250; i++) length += sprintf(workloads[2].source + length, "(x-");
+    workloads[2].source[length++] = '1';
+    for (int i = 0; i < 250; i++) workloads[2].source[length++] = ')';
+    workloads[2].source[length] = '\0';
+
+    workloads[3].name = "variables";
+    length = 0;
+    for (int i = 0; i < 256; i++) {
+        name[0] = (char) ('a' + i / 26);
+        name[1] = (char) ('a' + i % 26);
+        length += sprintf(workloads[3].source + length, "%s%s", i ? (i % 2 ? " * " : " + ") : "", name);
+        append_SMEItem(workloads[3].vars, new_SMEVar(name, 1 + i % 7 * 0.125));
+    }
+
+    char* short_vars[] = { "a", "b", "x", "y" };
+    for (int i = 0; i < 4; i++) {
+        append_SMEItem(workloads[0].vars, new_SMEVar(short_vars[i], i + 1.5));
+        append_SMEItem(workloads[1].vars, new_SMEVar(short_vars[i], i + 1.5));
+        append_SMEItem(workloads[2].vars, new_SMEVar(short_vars[i], i + 1.5));
+    }
+
+    for (int w = 0; w < 4; w++) {
+        BenchWorkload* workload = &workloads[w];
+        workload->tokenizer = sme_tokenize(workload->source, workload->vars);
+        workload->tokens = workload->tokenizer->list->count;
+        workload->root = sme_parse(workload->tokenizer);
+        workload->expr = sme_compile(workload->source, workload->vars);
+        /* Roughly the same time per workload */
+        long calls = iterations / (workload->tokens * 4);
+        if (calls < BENCH_SAMPLES) calls = BENCH_SAMPLES;
+
+        bench_measure("tokenize", workload->name, bench_suite_tokenize, workload, calls, 1, workload->tokens);
+        bench_measure("parse", workload->name, bench_suite_parse, workload, calls, 1, workload->tokens);
+        bench_measure("eval", workload->name, bench_suite_eval, workload, calls * 4, 1, workload->tokens);
+        bench_measure("compile", workload->name, bench_suite_compile, workload, calls, 1, workload->tokens);
+        bench_measure("vm", workload->name, bench_suite_vm, workload, calls * 4, 1, workload->tokens);
+    }
+
+    /* Per row, the short expression over columns of 4096 rows */
+    BenchBatch batch;
+    batch.expr = workloads[0].expr;
+    batch.rows = 4096;
+    batch.out = malloc(sizeof(double) * batch.rows);
+    batch.columns = malloc(sizeof(double*) * batch.expr->slots->count);
+    for (int j = 0; j < batch.expr->slots->count; j++) {
+        batch.columns[j] = malloc(sizeof(double) * batch.rows);
+        for (int i = 0; i < batch.rows; i++) batch.columns[j][i] = (i % 97) * 0.25 + j + 1;
+    }
+    bench_measure("batch", "short, 4096 rows", bench_suite_batch, &batch, iterations / batch.rows + 1, batch.rows, 0);
+
+    for (int j = 0; j < batch.expr->slots->count; j++) free(batch.columns[j]);
+    free(batch.columns);
+    free(batch.out);
+    for (int w = 0; w < 4; w++) {
+        BenchWorkload* workload = &workloads[w];
+        free_SMENode(workload->root);
+        free_SMEExpr(workload->expr);
+        workload->tokenizer->variables = NULL;
+        free_SMETokenizer(workload->tokenizer);
+        for (int i = 0; i < workload->vars->count; i++) free_SMEVar(workload->vars->items[i]);
+        free_SMEList(workload->vars);
+        free(workload->source);
+    }
+}
+
+/* sme_bench [iterations] [--csv | --json] [--suite] */
+int main(int argc, char** argv) {
+    long iterations = 5000000;
+    int suite_only = 0;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--csv")) bench_format = BenchCSV;
+        else if (!strcmp(argv[i], "--json")) bench_format = BenchJSON;
+        else if (!strcmp(argv[i], "--suite")) suite_only = 1;
+        else iterations = strtol(argv[i], NULL, 10);
+    }
+    bench_suite(iterations);
+    if (suite_only) {
+        bench_finish();
+        return 0;
+    }
+    for (int i = 0; i < (int) (sizeof(bench_exprs) / sizeof(bench_exprs[0])); i++) {
+        bench_eval(bench_exprs[i], iterations);
+        bench_optimize(bench_exprs[i], iterations);
+        bench_jit(bench_exprs[i], iterations);
+        bench_static(bench_exprs[i], iterations);
+        bench_image(bench_exprs[i], iterations / 10);
+    }
+    bench_dag(iterations);
+    bench_threads(bench_exprs[2], iterations);
+    bench_calc(bench_exprs[0], iterations / 10);
+    bench_cache(1000, iterations / 10);
+    bench_lex(10, iterations / 100);
+    bench_lex(1000, iterations / 10000);
+    bench_stream(200000, 4096);
+    bench_nesting(100, iterations / 100, 1);
+    bench_nesting(10000, iterations / 10000, 1);
+    bench_nesting(1000000, 1, 0);
+    bench_lookup(10, iterations / 10);
+    bench_lookup(100, iterations / 10);
+    bench_lookup(10000, iterations / 100);
+    bench_program(iterations / 100);
+    bench_incremental(iterations / 10);
+    for (int i = 1; i < (int) (sizeof(bench_exprs) / sizeof(bench_exprs[0])); i++) {
+        bench_batch(bench_exprs[i], (int) iterations);
+    }
+    for (int i = 0; i < (int) (sizeof(bench_calls) / sizeof(bench_calls[0])); i++) {
+        bench_batch(bench_calls[i], (int) iterations / 10);
+    }
+    bench_parallel(bench_exprs[2], (int) iterations * 2);
+    bench_bulk((int) (iterations / 50));
+    bench_finish();
+    return 0;
+}
@@ -0,0 +1,3 @@
+/* libsme, the library compiled as one translation unit so calls inside it can inline */
+#define SME_IMPLEMENTATION
+#include "sme.h"
@@ -2,10 +2,11 @@
 
 int main() {
     int flag = 1;
+    int stats = 0;
     char buffer[1024];
     char var_name[32];
     char var_value[32];
-    SMEList* vars = new_SMEList();
+    SMEVarTable* vars = new_SMEVarTable();
     while (flag) {
         printf("sme> ");
         scanf("%[^\n]\0", &buffer);
@@ -15,6 +16,14 @@ int main() {
             flag = 0;
             printf("\nQuitting\n");
         }
+        else if (!strcmp(buffer, "stats")) {
+            if (sme_stats_last() == NULL) {
+                printf("\nBuilt without SME_STATS\n");
+            } else {
+                stats = !stats;
+                printf("\nStats %s\n", stats ? "on" : "off");
+            }
+        }
         else if (buffer[0] == ':') {
             int i = 1;
             int j = 0;
@@ -28,17 +37,13 @@ int main() {
                 var_value[j++] = buffer[i++];
             }
             var_value[j] = '\0';
-            SMEVar* var = new_SMEVar(var_name, strtod(var_value, NULL));
-            append_SMEItem(vars, var);
+            sme_var_set(vars, var_name, strtod(var_value, NULL));
         }
         else {
-            SMETokenizer* tokenizer = sme_tokenize(buffer, vars);
-            SMENode* root = sme_parse(tokenizer);
-            printf("\nResult: %lf\n", sme_eval(root));
-            tokenizer->variables = NULL;
-            free_SMETokenizer(tokenizer);
-            free_SMENode(root);
+            printf("\nResult: %lf\n", sme_calc_table(buffer, vars));
+            if (stats) sme_stats_dump(sme_stats_last(), stdout);
         }
     }
+    free_SMEVarTable(vars);
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,24 @@
+#include "sme.hpp"
+#include "sme_static.h"
+
+#define SME_STATIC(source) { source, sme::expr<source>::slots, sme::expr<source>::eval }
+
+/* Grammar checks that need no values */
+static_assert(sme::expr<"8 / 4 / 2">::eval(nullptr) == 4, "* and / associate right");
+static_assert(sme::expr<"8 - 4 - 2">::eval(nullptr) == 2, "+ and - associate left");
+static_assert(sme::expr<"-2 * -3 + +(1 - 4)">::eval(nullptr) == 9, "unary operators bind to the next factor");
+static_assert(sme::expr<"floor(-2.5) + ceil 2.5">::eval(nullptr) == 0, "floor and ceil take a factor");
+static_assert(sme::expr<"b * a + b">::slot("a") == 1, "slots in order of first appearance");
+
+extern "C" const SMEStaticFormula sme_static_formulas[] = {
+        SME_STATIC("+(2 * (4 / (2.2 + -5.4) - 22) * 2 + ceil(floor(33.4 + 2.4) * 2.4))"),
+        SME_STATIC("a + b * x / y"),
+        SME_STATIC("floor(a * b + x) - ceil(a * b + y) * (a - b) / (x + y) + -a * -b"),
+        SME_STATIC("a * b / c - a / b * c"),
+        SME_STATIC("a - b - c + -a - -b"),
+        SME_STATIC("+(a - b) * floor(c / 0.5) + ceil -a"),
+        SME_STATIC("0.1 + 12345.678 * x - 0.000001 / y"),
+        SME_STATIC("((((a))))")
+};
+
+extern "C" const int sme_static_count = sizeof(sme_static_formulas) / sizeof(sme_static_formulas[0]);
@@ -0,0 +1,26 @@
+#ifndef SME_STATIC_H
+#define SME_STATIC_H
+
+/* Formulas compiled through sme.hpp, exported to C so the tests and the benchmark can hold them
+ * against sme_compile. The first entries are the benchmark expressions. */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef double (*SMEStaticFunction)(const double* values);
+
+typedef struct SMEStaticFormula {
+    const char* source;
+    int slots;
+    SMEStaticFunction function;
+} SMEStaticFormula;
+
+extern const SMEStaticFormula sme_static_formulas[];
+extern const int sme_static_count;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif